@@ -2,7 +2,8 @@
  * Little (SoundTracker/ProTracker) Module Player
  *
  * World's simplest ProTracker module player.  Supports 4 channel 15- or
- * 31-instrument SoundTracker/ProTracker modules.  Doesn't support exotic
+ * 31-instrument SoundTracker/ProTracker modules, and the multichannel ones
+ * (6CHN, 8CHN, FLT8, xxCH etc.) of their successors.  Doesn't support exotic
  * effects.  We may disagree on what constitutes "exotic".  :-)
  *
  * Outputs stereo or mono s16 at a configurable rate (default 44.1KHz).
@@ -10,8 +11,9 @@
  *
  * Initialise player/state:
  *
- *	mps_t	mpstate;
- * 	lmp_init(&mpstate, pointer_to_modfile);
+ *	lmp_module_t	module;
+ *	mps_t		mpstate;
+ * 	lmp_init(&mpstate, &module, pointer_to_modfile);
  *      lmp_set_option(&mpstate, ...); // Optional, configure looping
  *
  * Generate samples repeatedly, to fill audio buffer:
@@ -29,31 +31,117 @@
 ////////////////////////////////////////////////////////////////////////////////
 /* Tunables, define by your project: */
 
+/* Default output sample rate, see LMP_OPT_SAMPLERATE: */
 #ifndef LMP_SAMPLERATE
 #define LMP_SAMPLERATE		44100
 #endif
 
+/* Alignment of instruments copied into an arena by lmp_load_arena(): */
+#ifndef LMP_ARENA_ALIGN
+#define LMP_ARENA_ALIGN		64
+#endif
+
+/* Frames mixed per pass; sets the stack used by the mix accumulators. */
+#ifndef LMP_MIX_CHUNK
+#define LMP_MIX_CHUNK		128
+#endif
+
+/* Mixers to build, as LMP_BUILD_xxx mix types or'd with output types (see
+ * littlemodplayer.h); the rest return -1:
+ */
+#ifndef LMP_BUILD_MIXERS
+#define LMP_BUILD_MIXERS	LMP_BUILD_ALL
+#endif
+
+/* Channel counts (as a mask, bit n for n channels) that get mixers of their
+ * own; other counts share a generic one.  0 for the smallest code.
+ */
+#ifndef LMP_SPECIALISE_CHANNELS
+#define LMP_SPECIALISE_CHANNELS	((1U << 4) | (1U << 6) | (1U << 8))
+#endif
+
+/* Optional parts of the player to build, as LMP_FEATURE_xxx (see
+ * littlemodplayer.h) or'd together; e.g. 0 for the smallest code.
+ */
+#ifndef LMP_BUILD_FEATURES
+#define LMP_BUILD_FEATURES	LMP_FEATURE_ALL
+#endif
+
+/* Interpolation kernels to build, as a mask of (1 << LMP_INTERP_xxx).
+ * Linear is always built.
+ */
+#ifndef LMP_BUILD_INTERP
+#define LMP_BUILD_INTERP	0xf
+#endif
+
 #ifndef LMP_DEBUG_LEVEL
 #define LMP_DEBUG_LEVEL 	-1
 #endif
 
+/* Define LMP_STATS to keep counters (see lmp_get_stats()), and LMP_CYCLES()
+ * to override how they're timed.
+ */
+
 ////////////////////////////////////////////////////////////////////////////////
 
-#define SAMPLES_PER_TICK	(LMP_SAMPLERATE/50)
 #define SAMP_FP_SPLIT		12	/* 20:12 FP */
 
+/* Range of periods that portamento clamps to, and that the period-to-phase
+ * increment table covers:
+ */
+#define PERIOD_MIN		113
+#define PERIOD_MAX		856
+
+/* Range of tempos that Fxx can set: */
+#define TEMPO_MIN		32
+#define TEMPO_MAX		255
+
+/* Space taken by an instrument in the arena (see lmp_load_arena()) */
+#define ARENA_SLOT(len)		(((len) + LMP_ARENA_GUARD + LMP_ARENA_FRONT + LMP_ARENA_ALIGN - 1) & \
+				 ~(LMP_ARENA_ALIGN - 1))
+
+#define INTERP_BUILT(i)		((LMP_BUILD_INTERP | (1U << LMP_INTERP_LINEAR)) & (1U << (i)))
+#define FEATURE_BUILT(f)	(LMP_BUILD_FEATURES & LMP_FEATURE_##f)
+
+#if LMP_MAX_CHANNELS > 32
+#error "LMP_MAX_CHANNELS is limited by the 32-bit active channel mask"
+#endif
+
 #define BS16(x)			( (((x) >> 8) & 0xff) | (((x) << 8) & 0xff00) )
 
 #ifdef BIG_ENDIAN
 #define BE_to_host16(x)		( (x) )
 #define host_to_LE16(x)		( BS16(x) )
-#define host_to_LE32(x)		( BS32(x) )
 #else /* LE, default */
 #define BE_to_host16(x)		( BS16(x) )
 #define host_to_LE16(x)		( (x) )
-#define host_to_LE32(x)		( (x) )
 #endif
 
+/* Vector mixing kernels are used where the compiler says they're available,
+ * unless LMP_NO_SIMD is defined.  (They skip the per-sample debug.)
+ */
+#if !defined(LMP_NO_SIMD) && LMP_DEBUG_LEVEL < 5
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LMP_SIMD_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LMP_SIMD_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LMP_SIMD_NEON
+#elif defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+#define LMP_SIMD_DSP
+#endif
+#if defined(LMP_SIMD_AVX2) || defined(LMP_SIMD_SSE2) || \
+    defined(LMP_SIMD_NEON) || defined(LMP_SIMD_DSP)
+#define LMP_SIMD
+#endif
+#endif
+
+#define LMP_ALWAYS_INLINE	inline __attribute__((always_inline))
+
 #if LMP_DEBUG_LEVEL >= 0
 #include <stdio.h>
 #define MPDBG(l, x...)	       	do { if (LMP_DEBUG_LEVEL >= (l)) printf(x); } while(0)
@@ -62,17 +150,48 @@
 #define MPDBG(l, x...)	       	do { } while(0)
 #endif
 
+#ifdef LMP_STATS
+#define STAT(x...)		x
+#ifndef LMP_CYCLES
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+/* DWT CYCCNT: the project must enable it (DEMCR.TRCENA, DWT_CTRL.CYCCNTENA) */
+#define LMP_CYCLES()		(*(volatile uint32_t *)0xe0001004)
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LMP_CYCLES()		((uint32_t)__rdtsc())
+#elif defined(__unix__) || defined(__APPLE__)
+#include <time.h>
+/* No cycle counter, so nanoseconds: */
+static uint32_t	lmp_cycles_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec*1000000000U + ts.tv_nsec;
+}
+#define LMP_CYCLES()		lmp_cycles_ns()
+#else
+#define LMP_CYCLES()		0
+#endif
+#endif
+#else
+/* Stats compile away entirely: */
+#define STAT(x...)
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /* Utilities */
 
-static unsigned int	lmp_samps_from_tempo(unsigned int tempo)
+static unsigned int	lmp_samps_from_tempo(mps_t *mps, unsigned int tempo)
 {
-	/* 125 = 50Hz = LMP_SAMPLERATE/50. */
-	return (125*LMP_SAMPLERATE/50)/tempo;
+	/* 125 = 50Hz = samplerate/50. */
+	if (mps->tables)
+		return mps->tables->spt_table[tempo - TEMPO_MIN];
+	return (125*mps->samplerate/50)/tempo;
 }
 
-static uint32_t 	lmp_pi_from_pitch(uint16_t pitch)
+static uint32_t 	lmp_pi_from_pitch(mps_t *mps, uint16_t pitch)
 {
 	/* Note pitch is in units of 3.579545MHz ticks between samples.
 	 * I.e. higher values are a lower output sample rate Range is 0x71 to
@@ -86,97 +205,309 @@ static uint32_t 	lmp_pi_from_pitch(uint16_t pitch)
 	 * 3.579545/0.014MHz = 255.68)
 	 *
 	 * Assuming the source sample is 14KHz, it means the output is a ratio
-	 * of LMP_SAMPLERATE/14000, e.g. output one instrument sample 3.15
+	 * of samplerate/14000, e.g. output one instrument sample 3.15
 	 * times to output.
 	 *
-	 * IOW, instrument sample is output freq*LMP_SAMPLERATE/(14000*254)
+	 * IOW, instrument sample is output freq*samplerate/(14000*254)
 	 * times, so phase inc is 1/that (in fixed-point format).
 	 *
-	 * FIXME: a LUT is faster than a reciprocal!!!!!!!!!111
+	 * A LUT is faster than a reciprocal, so look up the usual range of
+	 * periods.  Some modules use notes outside it; divide for those.
 	 */
-	return ((1UL<<SAMP_FP_SPLIT)*254*14000ULL/LMP_SAMPLERATE)/(unsigned int)pitch;
+	if (mps->tables && pitch >= PERIOD_MIN && pitch <= PERIOD_MAX)
+		return mps->tables->pi_table[pitch - PERIOD_MIN];
+	return mps->pi_num/(unsigned int)pitch;
+}
+
+/* Phase increment for period 1, for voices mixed at a rate: */
+#define PI_NUM(rate)		((uint32_t)((1UL<<SAMP_FP_SPLIT)*254*14000ULL/(rate)))
+
+/* The tables for LMP_SAMPLERATE are generated at compile time, so live in
+ * flash rather than RAM.  Entries are 16 bits, which is enough for rates
+ * from 2KHz up.
+ */
+#define SPT1(t)			((uint16_t)((125*LMP_SAMPLERATE/50)/(t)))
+#define PI1(p)			((uint16_t)(PI_NUM(LMP_SAMPLERATE)/(p)))
+#define GEN4(f, x)		f(x), f((x)+1), f((x)+2), f((x)+3)
+#define GEN16(f, x)		GEN4(f, x), GEN4(f, (x)+4), GEN4(f, (x)+8), GEN4(f, (x)+12)
+#define GEN64(f, x)		GEN16(f, x), GEN16(f, (x)+16), GEN16(f, (x)+32), GEN16(f, (x)+48)
+
+#if FEATURE_BUILT(TABLES)
+static const lmp_rate_tables_t	lmp_default_tables = {
+	.samplerate = LMP_SAMPLERATE,
+	.rate_shift = 0,
+	.spt_table = {
+		GEN64(SPT1, 32), GEN64(SPT1, 96), GEN64(SPT1, 160),
+		GEN16(SPT1, 224), GEN16(SPT1, 240)
+	},
+	.pi_table = {
+		GEN64(PI1, 113), GEN64(PI1, 177), GEN64(PI1, 241), GEN64(PI1, 305),
+		GEN64(PI1, 369), GEN64(PI1, 433), GEN64(PI1, 497), GEN64(PI1, 561),
+		GEN64(PI1, 625), GEN64(PI1, 689), GEN64(PI1, 753),
+		GEN16(PI1, 817), GEN16(PI1, 833), GEN4(PI1, 849), GEN4(PI1, 853)
+	}
+};
+#endif
+
+/* The rate shift actually used at a rate: voices are mixed at no less than 2KHz */
+static unsigned int	lmp_limit_rate_shift(unsigned int rate, unsigned int shift)
+{
+	while (shift && (rate >> shift) < 2000)
+		shift--;
+	return shift;
+}
+
+static int	lmp_tables_match(const lmp_rate_tables_t *t, unsigned int rate, unsigned int shift)
+{
+	return t && t->samplerate == rate && t->rate_shift == shift;
+}
+
+/* Set the output rate, and with it the rate voices are mixed at (which can be
+ * less), and pick up the tables for them if there are any.
+ */
+static void	lmp_set_samplerate(mps_t *mps, unsigned int rate)
+{
+	mps->rate_shift = lmp_limit_rate_shift(rate, mps->rate_shift);
+	mps->sub_frame &= (1U << mps->rate_shift) - 1;
+
+	mps->samplerate = rate;
+	mps->pi_num = PI_NUM(rate >> mps->rate_shift);
+
+	if (lmp_tables_match(mps->rate_tables, rate, mps->rate_shift))
+		mps->tables = mps->rate_tables;
+#if FEATURE_BUILT(TABLES)
+	else if (lmp_tables_match(&lmp_default_tables, rate, mps->rate_shift))
+		mps->tables = &lmp_default_tables;
+#endif
+	else
+		mps->tables = NULL;
+}
+
+#define IS_DIGIT(c)		((c) >= '0' && (c) <= '9')
+
+/* Returns the number of channels given by the tag of a 31-instrument module
+ * (at 0x438), or -1 if it's not a tag we know, i.e. this is a 15-instrument
+ * SoundTracker module.  Sets *flt8 for Startrekker's 8 channel format, and
+ * *packed for a module packed by lmp_pack.
+ */
+static int	lmp_tag_channels(const char *tag, uint8_t *flt8, uint8_t *packed)
+{
+	*flt8 = 0;
+	*packed = 0;
+	/* Written by lmp_pack, with the instruments packed: */
+	if (tag[0] == 'L' && tag[1] == 'P' && IS_DIGIT(tag[2]) && IS_DIGIT(tag[3])) {
+		*packed = 1;
+		return (tag[2] - '0')*10 + (tag[3] - '0');
+	}
+	if (!strncmp(tag, "M.K.", 4) || !strncmp(tag, "M!K!", 4) ||
+	    !strncmp(tag, "FLT4", 4) || !strncmp(tag, "4CHN", 4))
+		return 4;
+	if (!strncmp(tag, "FLT8", 4)) {
+		*flt8 = 1;
+		return 8;
+	}
+	if (!strncmp(tag, "OCTA", 4) || !strncmp(tag, "CD81", 4))
+		return 8;
+	/* TakeTracker TDZ1-3, xCHN (FastTracker 6CHN/8CHN), xxCH/xxCN: */
+	if (!strncmp(tag, "TDZ", 3) && IS_DIGIT(tag[3]))
+		return tag[3] - '0';
+	if (IS_DIGIT(tag[0]) && !strncmp(tag + 1, "CHN", 3))
+		return tag[0] - '0';
+	if (IS_DIGIT(tag[0]) && IS_DIGIT(tag[1]) &&
+	    (!strncmp(tag + 2, "CH", 2) || !strncmp(tag + 2, "CN", 2)))
+		return (tag[0] - '0')*10 + (tag[1] - '0');
+	return -1;
+}
+
+/* Decode a block of a packed instrument (see LMP_PACK_BLOCK).  The deltas
+ * were chosen against the decoded samples, clamped as they are here, so
+ * errors don't build up along the block.
+ */
+static void	lmp_unpack_block(int8_t *out, const uint8_t *block)
+{
+	int s = (int8_t)block[0];
+	int scale = 1 << (block[1] & 7);
+
+	for (int i = 0; i < LMP_PACK_BLOCK; i++) {
+		int d = (block[2 + i/2] >> ((i & 1) * 4)) & 0xf;
+
+		s += ((d ^ 8) - 8) * scale;
+		s = (s < -128) ? -128 : (s > 127) ? 127 : s;
+		out[i] = s;
+	}
 }
 
+/* Decode the first len samples of a packed instrument */
+static void	lmp_unpack(int8_t *dest, const uint8_t *src, unsigned int len)
+{
+	int8_t block[LMP_PACK_BLOCK];
+
+	for (unsigned int i = 0; i < len; i += LMP_PACK_BLOCK) {
+		unsigned int n = (len - i < LMP_PACK_BLOCK) ? len - i : LMP_PACK_BLOCK;
+
+		lmp_unpack_block(block, src);
+		memcpy(dest + i, block, n);
+		src += LMP_PACK_BLOCK_BYTES;
+	}
+}
+
+/* Loop cache, see below */
+static void	lmp_cache_drop(mps_t *mps);
+static int	lmp_cache_play(mps_t *mps, int16_t *samples, unsigned int n, lmp_mix_t mix_type);
+static int	lmp_cache_record(mps_t *mps, const int16_t *samples, unsigned int n,
+				 unsigned int frames, lmp_mix_t mix_type);
+static int	lmp_cache_loop(mps_t *mps, lmp_mix_t mix_type);
+
 ////////////////////////////////////////////////////////////////////////////////
 /* Public functions */
 
-int 	lmp_init(mps_t *mps, uint8_t *mod_base)
+/* Parse a module in memory.  Returns 0, or -1 if the module has more
+ * channels than LMP_MAX_CHANNELS.
+ */
+int	lmp_module_init(lmp_module_t *mod, uint8_t *mod_base)
 {
 	int tss = 0;
-	/* FIXME: detect 15 vs 31-sample format */
-	mps->mod_data = mod_base;
+	int channels;
 
-	mps->thirtyone = !strncmp("M.K.", (char *)(mod_base + 0x438), 4);
+	mod->mod_data = mod_base;
+	mod->notes = 0;
+	mod->notes_map = 0;
+	mod->guarded = 0;
+
+	channels = lmp_tag_channels((char *)(mod_base + 0x438), &mod->flt8, &mod->packed);
+	mod->thirtyone = channels >= 0;
+	if (channels < 0)
+		channels = 4;
+	if (channels == 0 || channels > LMP_MAX_CHANNELS)
+		return -1;
+	mod->channels = channels;
 
 	uint8_t *instruments = mod_base + 0x14;
-	mps->instruments = instruments;
+	mod->instruments = instruments;
 
 	/* Unpack module header into more convenient format: */
-	if (mps->thirtyone) {
-		mps->length = mod_base[0x3b6];
-		mps->sequence = mod_base + 0x3b8;
-		mps->patterns = (uint32_t *)(mod_base + 0x43c);
+	if (mod->thirtyone) {
+		mod->length = mod_base[0x3b6];
+		mod->sequence = mod_base + 0x3b8;
+		mod->patterns = (uint32_t *)(mod_base + 0x43c);
 	} else {
-		mps->length = mod_base[0x1d6];
-		mps->sequence = mod_base + 0x1d8;
-		mps->patterns = (uint32_t *)(mod_base + 0x258);
+		mod->length = mod_base[0x1d6];
+		mod->sequence = mod_base + 0x1d8;
+		mod->patterns = (uint32_t *)(mod_base + 0x258);
 	}
 
 	/* Scan sequence for max pattern number: */
 	unsigned int max_patt = 0;
 	for (int i = 0; i < 128; i++) {
-		MPDBG(1, "%03d: %03d\n", i, mps->sequence[i]);
-		if (mps->sequence[i] > max_patt)
-			max_patt = mps->sequence[i];
+		MPDBG(1, "%03d: %03d\n", i, mod->sequence[i]);
+		if (mod->sequence[i] > max_patt)
+			max_patt = mod->sequence[i];
 	}
+	if (mod->flt8)
+		max_patt /= 2;
 
 	MPDBG(0, "Module name:   %s\n"
 	      " length:       %d\n"
 	      " max pattern:  %d\n"
-	      , (char *)(mod_base + 0), mps->length, max_patt);
+	      " channels:     %d\n"
+	      , (char *)(mod_base + 0), mod->length, max_patt, mod->channels);
 
-	int8_t *samples_at = (int8_t *)&mps->patterns[256*(max_patt + 1)];
+	int8_t *samples_at = (int8_t *)&mod->patterns[64*mod->channels*(max_patt + 1)];
 	int8_t *last_sample = samples_at;
-	for (int i = 0; i < (mps->thirtyone ? 31 : 15); i++) {
+	for (int i = 0; i < (mod->thirtyone ? 31 : 15); i++) {
 		uint16_t *instr = (uint16_t *)(instruments + (i*30));
-		mps->inst[i].sample = last_sample;
-		mps->inst[i].len = BE_to_host16(instr[10+1])*2;	 		/* Length in halfwords */
-		mps->inst[i].default_volume = 0x7f & BE_to_host16(instr[10+2]);	/* 0-64 inclusive */
-		mps->inst[i].repeat_pos = BE_to_host16(instr[10+3])*2;
-		mps->inst[i].repeat_len = BE_to_host16(instr[10+4])*2;		/* 1 = no repeat (hmm) */
-		last_sample = last_sample + mps->inst[i].len;
+		mod->inst[i].sample = last_sample;
+		mod->inst[i].len = BE_to_host16(instr[10+1])*2;	 		/* Length in halfwords */
+		mod->inst[i].default_volume = 0x7f & BE_to_host16(instr[10+2]);	/* 0-64 inclusive */
+		mod->inst[i].repeat_pos = BE_to_host16(instr[10+3])*2;
+		mod->inst[i].repeat_len = BE_to_host16(instr[10+4])*2;		/* 1 = no repeat (hmm) */
+		last_sample = last_sample + (mod->packed ? LMP_PACK_SIZE(mod->inst[i].len) :
+					     mod->inst[i].len);
 
 		MPDBG(0, "Instrument %2d at %p (+0x%08lx): len %4x vol %2d repeat pos %4x rlen %4x %s\n",
-		      i, mps->inst[i].sample, (uint8_t *)mps->inst[i].sample-mod_base, mps->inst[i].len,
-		      mps->inst[i].default_volume, mps->inst[i].repeat_pos, mps->inst[i].repeat_len,
+		      i, mod->inst[i].sample, (uint8_t *)mod->inst[i].sample-mod_base, mod->inst[i].len,
+		      mod->inst[i].default_volume, mod->inst[i].repeat_pos, mod->inst[i].repeat_len,
 		      (char *)instr);
 	}
 
-	for (int i = 0; i < 4; i++) {
-		mps->cs[i].on = 0;
-		mps->cs[i].inst = 0;
-		mps->cs[i].vol = 0x40;
-		mps->cs[i].effect = 0xff;
-	}
+	return 0;
+}
 
+/* Put the sequencer at the start of the song */
+static void	lmp_sequencer_reset(mps_t *mps)
+{
 	mps->speed = 6;
 	mps->tick_counter = 0;
 	mps->pos = 0;
 	mps->pos_pattern = 0;
 
 	mps->tempo = 125;
-	mps->samples_per_tick = lmp_samps_from_tempo(mps->tempo);
+	mps->samples_per_tick = lmp_samps_from_tempo(mps, mps->tempo);
 	mps->sample_counter = mps->samples_per_tick;
+	mps->new_pos = 1;
+	mps->loop_row = mps->loop_count = 0;
+	mps->pattern_delay = 0;
+}
+
+/* Start a player on a module, which must stay put.  Any number of players can
+ * share one module.  Returns 0, or -1 for a packed module when LMP_PACK_WINDOW
+ * is 0 (unpack it with lmp_load_arena() first).
+ */
+int	lmp_player_init(mps_t *mps, const lmp_module_t *mod)
+{
+	if (mod->packed && !LMP_PACK_WINDOW)
+		return -1;
+	mps->mod = mod;
+	mps->stream = NULL;
+	mps->cache = NULL;
+
+	for (int i = 0; i < LMP_MAX_CHANNELS; i++) {
+		memset(&mps->cs[i], 0, sizeof(mpschan_t));
+		mps->cs[i].vol = mps->cs[i].volume = 0x40;
+		mps->cs[i].effect = 0xff;
+	}
+
+	mps->active = 0;
+	mps->silent = 1;
+	mps->events = NULL;
+	mps->max_events = mps->num_events = 0;
+	mps->event_frame = 0;
+	mps->rate_shift = 0;
+	mps->mute = 0;
+	mps->sub_frame = 0;
+	memset(mps->up, 0, sizeof(mps->up));
+	mps->rate_tables = NULL;
+#if LMP_PACK_WINDOW
+	for (int i = 0; i < LMP_MAX_CHANNELS; i++)
+		mps->window[i].src = NULL;
+#endif
+	STAT(lmp_reset_stats(mps));
+
+	lmp_set_samplerate(mps, LMP_SAMPLERATE);
+	lmp_sequencer_reset(mps);
 
 	/* Defaults to looping */
 	mps->song_loop = 1;
 	mps->support_tempo = 1;
+	mps->interp = LMP_INTERP_LINEAR;
 
 	return 0;
 }
 
+/* Parse a module and start a player on it, for the common case of one
+ * player per module.
+ */
+int 	lmp_init(mps_t *mps, lmp_module_t *mod, uint8_t *mod_base)
+{
+	if (lmp_module_init(mod, mod_base))
+		return -1;
+	return lmp_player_init(mps, mod);
+}
+
 void	lmp_set_option(mps_t *mps, unsigned int option, unsigned int val)
 {
+	lmp_cache_drop(mps);
+
 	switch (option) {
 		case LMP_OPT_LOOP:
 			mps->song_loop = !!val;
@@ -186,54 +517,496 @@ void	lmp_set_option(mps_t *mps, unsigned int option, unsigned int val)
 			mps->support_tempo = !!val;
 			break;
 
+		case LMP_OPT_RATE_SHIFT:
+			if (val > 2 || !FEATURE_BUILT(RATE_SHIFT))
+				break;
+			mps->rate_shift = val;
+			mps->sub_frame = 0;
+			memset(mps->up, 0, sizeof(mps->up));
+			/* Rebuild the pitch table, at the current rate: */
+			val = mps->samplerate;
+			/* Fall through */
+		case LMP_OPT_SAMPLERATE:
+			if (val < 4000 || val > 192000)
+				break;
+			lmp_set_samplerate(mps, val);
+			/* Carry on at the current tempo/pitches, at the new rate: */
+			mps->samples_per_tick = lmp_samps_from_tempo(mps, mps->tempo);
+			if (mps->sample_counter > mps->samples_per_tick)
+				mps->sample_counter = mps->samples_per_tick;
+			for (int chan = 0; chan < mps->mod->channels; chan++) {
+				if (mps->cs[chan].on)
+					mps->cs[chan].phaseinc = lmp_pi_from_pitch(mps, mps->cs[chan].pitch);
+			}
+			break;
+
+		case LMP_OPT_INTERP:
+			if (val <= LMP_INTERP_SINC && INTERP_BUILT(val))
+				mps->interp = val;
+			break;
+
+		case LMP_OPT_MUTE:
+			mps->mute = val;
+			break;
+
 		default:
 			break;
 	}
 }
 
+void	lmp_rate_tables_init(lmp_rate_tables_t *t, unsigned int samplerate, unsigned int rate_shift)
+{
+	unsigned int shift = lmp_limit_rate_shift(samplerate, rate_shift);
+	uint32_t pi_num = PI_NUM(samplerate >> shift);
+
+	t->samplerate = samplerate;
+	t->rate_shift = shift;
+	for (unsigned int tempo = TEMPO_MIN; tempo <= TEMPO_MAX; tempo++)
+		t->spt_table[tempo - TEMPO_MIN] = (125*samplerate/50)/tempo;
+	for (unsigned int p = PERIOD_MIN; p <= PERIOD_MAX; p++)
+		t->pi_table[p - PERIOD_MIN] = pi_num/p;
+}
+
+/* The tables only save divides, so changing them changes nothing heard */
+void	lmp_set_rate_tables(mps_t *mps, const lmp_rate_tables_t *t)
+{
+	mps->rate_tables = t;
+	lmp_set_samplerate(mps, mps->samplerate);
+}
+
+#ifdef LMP_STATS
+const lmp_stats_t	*lmp_get_stats(mps_t *mps)
+{
+	return &mps->stats;
+}
+
+void	lmp_reset_stats(mps_t *mps)
+{
+	memset(&mps->stats, 0, sizeof(mps->stats));
+}
+
+static void	lmp_stats_tick_done(mps_t *mps, uint32_t cycles)
+{
+	mps->stats.tick_cycles = cycles;
+	if (cycles > mps->stats.tick_cycles_max)
+		mps->stats.tick_cycles_max = cycles;
+	mps->stats.buffer_tick_cycles += cycles;
+}
+
+/* Called at the end of a buffer, given the cycle count and voice_samples at
+ * its start:
+ */
+static void	lmp_stats_buffer_done(mps_t *mps, uint32_t start, uint32_t voice_samples)
+{
+	uint32_t cycles = LMP_CYCLES() - start - mps->stats.buffer_tick_cycles;
+
+	mps->stats.mix_cycles = cycles;
+	if (cycles > mps->stats.mix_cycles_max)
+		mps->stats.mix_cycles_max = cycles;
+	mps->stats.buffer_voice_samples = mps->stats.voice_samples - voice_samples;
+}
+#endif
+
+/* Brackets the body of each of the buffer rendering functions: */
+#define STAT_BUFFER_START(mps)	STAT(uint32_t stat_start = LMP_CYCLES();		\
+				     uint32_t stat_vs = (mps)->stats.voice_samples;	\
+				     (mps)->stats.buffer_tick_cycles = 0)
+#define STAT_BUFFER_END(mps)	STAT(lmp_stats_buffer_done(mps, stat_start, stat_vs))
+
+/* Whether the last buffer filled was entirely silent (no voices playing),
+ * so a mixer downstream can skip it.
+ */
+int	lmp_last_buffer_silent(mps_t *mps)
+{
+	return mps->silent;
+}
+
 /* Total number of patterns in song sequence */
 unsigned int 	lmp_get_length(mps_t *mps)
 {
-	return mps->length;
+	return mps->mod->length;
 }
 
 /* Set position in song sequence (0..(length-1)) */
 void	lmp_set_pos(mps_t *mps, unsigned int pos)
 {
-	if (pos < mps->length) {
+	if (pos < mps->mod->length) {
+		lmp_cache_drop(mps);
 		mps->pos = pos;
 		mps->pos_pattern = 0;
+		mps->new_pos = 1;
+		mps->loop_row = mps->loop_count = 0;
+		mps->pattern_delay = 0;
+	}
+}
+
+#if FEATURE_BUILT(EVENTS)
+void	lmp_set_events(mps_t *mps, lmp_event_t *events, unsigned int max_events)
+{
+	lmp_cache_drop(mps);
+	mps->events = events;
+	mps->max_events = events ? max_events : 0;
+	mps->num_events = 0;
+}
+
+unsigned int	lmp_get_events(mps_t *mps, unsigned int *dropped)
+{
+	unsigned int n = (mps->num_events < mps->max_events) ? mps->num_events : mps->max_events;
+
+	if (dropped)
+		*dropped = mps->num_events - n;
+	return n;
+}
+#endif
+
+/* Record an event at the current frame, if there's room */
+static void	lmp_event(mps_t *mps, uint8_t type, unsigned int pos, unsigned int row,
+			  uint8_t chan, uint8_t value, uint8_t command)
+{
+	if (mps->num_events < mps->max_events) {
+		lmp_event_t *e = &mps->events[mps->num_events];
+
+		e->frame = mps->event_frame;
+		e->type = type;
+		e->pos = pos;
+		e->row = row;
+		e->chan = chan;
+		e->value = value;
+		e->command = command;
+	}
+	mps->num_events++;
+}
+
+static void	lmp_unpack_note(const uint8_t *b, mpsnote_t *note)
+{
+	/* Format of the pattern's word:
+	 *
+	 * Frequency = b0[3:0],b1[7:0]
+	 * Instrument = b0[4],b2[7:4]
+	 * Command = b2[3:0]
+	 * Value = b3[7:0]
+	 *
+	 * Unpacked bytewise, so the same on LE and BE.
+	 */
+	note->period = ((b[0] & 0xf) << 8) | b[1];
+	note->inst = (b[0] & 0x10) | (b[2] >> 4);
+	note->command = b[2] & 0xf;
+	note->val = b[3];
+	note->pad = 0;
+}
+
+/* Unpack a row of a pattern into notes[0..channels-1] */
+static void	lmp_unpack_row(const lmp_module_t *mod, uint8_t pattern, unsigned int row, mpsnote_t *notes)
+{
+	const uint8_t *raw;
+
+	if (mod->flt8) {
+		/* Channels 0-3 are in one 4 channel pattern and 4-7 in the
+		 * next.  The sequence numbers them in 4 channel patterns.
+		 */
+		raw = (const uint8_t *)&mod->patterns[512*(pattern/2) + 4*row];
+		for (int chan = 0; chan < 4; chan++) {
+			lmp_unpack_note(&raw[4*chan], &notes[chan]);
+			lmp_unpack_note(&raw[1024 + 4*chan], &notes[4 + chan]);
+		}
+	} else {
+		raw = (const uint8_t *)&mod->patterns[mod->channels*(64*pattern + row)];
+		for (int chan = 0; chan < mod->channels; chan++)
+			lmp_unpack_note(&raw[4*chan], &notes[chan]);
+	}
+}
+
+/* Bytes needed to predecode the patterns used by the song */
+unsigned int	lmp_predecode_size(const lmp_module_t *mod)
+{
+	uint8_t used[256];
+	unsigned int n = 0;
+
+	memset(used, 0, sizeof(used));
+	for (unsigned int i = 0; i < mod->length; i++) {
+		if (!used[mod->sequence[i]]++)
+			n++;
+	}
+	return LMP_NOTES_MAP_SIZE + n*64*mod->channels*sizeof(mpsnote_t);
+}
+
+/* Unpack the patterns used by the song into a buffer (which should be word
+ * aligned), so that rows are then read with plain loads.  Returns 0 for
+ * success, or -1 if the buffer is too small (and the player carries on
+ * reading the raw patterns).
+ */
+int	lmp_predecode(lmp_module_t *mod, void *buffer, unsigned int size)
+{
+	uint8_t *map = buffer;
+	mpsnote_t *notes = (mpsnote_t *)(map + LMP_NOTES_MAP_SIZE);
+	unsigned int n = 0;
+
+	if (size < lmp_predecode_size(mod))
+		return -1;
+
+	memset(map, 0xff, LMP_NOTES_MAP_SIZE);
+	for (unsigned int i = 0; i < mod->length; i++) {
+		uint8_t patt = mod->sequence[i];
+
+		if (map[patt] != 0xff)
+			continue;
+		map[patt] = n;
+
+		for (int row = 0; row < 64; row++)
+			lmp_unpack_row(mod, patt, row, &notes[mod->channels*(64*n + row)]);
+		n++;
+	}
+
+	mod->notes_map = map;
+	mod->notes = notes;
+	return 0;
+}
+
+/* Bytes needed to copy the instruments into a guard-padded arena, including
+ * slack for aligning the start of the arena, and an empty first slot for the
+ * first instrument's front guard.
+ */
+unsigned int	lmp_arena_size(const lmp_module_t *mod)
+{
+	unsigned int size = LMP_ARENA_ALIGN - 1 + ARENA_SLOT(0);
+
+	for (int i = 0; i < (mod->thirtyone ? 31 : 15); i++)
+		size += ARENA_SLOT(mod->inst[i].len);
+	return size;
+}
+
+/* Copy the instruments into an arena provided by the caller, each starting
+ * on an LMP_ARENA_ALIGN boundary and followed by LMP_ARENA_GUARD samples:
+ * the start of the loop for looped instruments, or silence.  Each is also
+ * preceded by LMP_ARENA_FRONT samples of silence (the end of the previous
+ * slot).  The mixer then doesn't need to check whether the samples around
+ * the current one are in range.  Loops that run past the end of their
+ * sample are clamped to it.
+ *
+ * Returns 0 for success, or -1 if the arena is too small (and the player
+ * carries on using the samples in the module).
+ */
+int	lmp_load_arena(lmp_module_t *mod, void *arena, unsigned int size)
+{
+	uintptr_t a = ((uintptr_t)arena + LMP_ARENA_ALIGN - 1) & ~(uintptr_t)(LMP_ARENA_ALIGN - 1);
+	int8_t *dest = (int8_t *)a + ARENA_SLOT(0);
+
+	if (size < lmp_arena_size(mod))
+		return -1;
+
+	memset((int8_t *)a, 0, ARENA_SLOT(0));
+
+	for (int i = 0; i < (mod->thirtyone ? 31 : 15); i++) {
+		mpsamp_t *in = &mod->inst[i];
+
+		if (mod->packed)
+			lmp_unpack(dest, (const uint8_t *)in->sample, in->len);
+		else
+			memcpy(dest, in->sample, in->len);
+
+		if (in->repeat_len != 1*2) {
+			if (in->repeat_pos >= in->len) {
+				in->repeat_pos = 0;
+				in->repeat_len = 1*2;
+			} else if (in->repeat_pos + in->repeat_len > in->len) {
+				in->repeat_len = in->len - in->repeat_pos;
+			}
+		}
+
+		for (int g = 0; g < LMP_ARENA_GUARD; g++) {
+			if (in->repeat_len != 1*2 && in->repeat_len)
+				dest[in->len + g] = dest[in->repeat_pos + (g % in->repeat_len)];
+			else
+				dest[in->len + g] = 0;
+		}
+		/* Silence up to the next, for its front guard: */
+		memset(dest + in->len + LMP_ARENA_GUARD, 0,
+		       ARENA_SLOT(in->len) - in->len - LMP_ARENA_GUARD);
+
+		in->sample = dest;
+		dest += ARENA_SLOT(in->len);
+	}
+
+	mod->guarded = 1;
+	mod->packed = 0;
+	return 0;
+}
+
+/* Effects
+ *
+ * Row effects are applied by lmp_process_command(), and the ones that carry
+ * on through a row once per tick by lmp_tick_effect(), from the tables
+ * below.  Both only change a voice's phaseinc and vol (and the pitch and
+ * volume they come from), so the mixers don't know about them.
+ */
+
+/* ProTracker's periods for C-1 to B-3, at finetune 0: */
+#define NUM_NOTES		36
+
+static const uint16_t lmp_note_periods[NUM_NOTES] = {
+	856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
+	428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
+	214, 202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113,
+};
+
+/* Vibrato and tremolo waveforms, selected by E4x/E7x (3 is square too) */
+static const int16_t lmp_waves[3][64] = {
+	{	/* Sine */
+		   0,   24,   49,   74,   97,  120,  141,  161,  180,  197,  212,  224,  235,  244,  250,  253,
+		 255,  253,  250,  244,  235,  224,  212,  197,  180,  161,  141,  120,   97,   74,   49,   24,
+		   0,  -24,  -49,  -74,  -97, -120, -141, -161, -180, -197, -212, -224, -235, -244, -250, -253,
+		-255, -253, -250, -244, -235, -224, -212, -197, -180, -161, -141, -120,  -97,  -74,  -49,  -24,
+	},
+	{	/* Ramp down */
+		 255,  247,  239,  231,  223,  215,  207,  199,  191,  183,  175,  167,  159,  151,  143,  135,
+		 127,  119,  111,  103,   95,   87,   79,   71,   63,   55,   47,   39,   31,   23,   15,    7,
+		   0,   -8,  -16,  -24,  -32,  -40,  -48,  -56,  -64,  -72,  -80,  -88,  -96, -104, -112, -120,
+		-128, -136, -144, -152, -160, -168, -176, -184, -192, -200, -208, -216, -224, -232, -240, -248,
+	},
+	{	/* Square */
+		 255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,
+		 255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,  255,
+		-255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255,
+		-255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255, -255,
+	},
+};
+
+/* The note at (or the first above) a period */
+static unsigned int	lmp_note_from_period(uint16_t period)
+{
+	unsigned int n = 0;
+
+	while (n < NUM_NOTES - 1 && lmp_note_periods[n] > period)
+		n++;
+	return n;
+}
+
+/* A waveform at a position, times depth, over 2^shift (rounded towards 0, as
+ * ProTracker does):
+ */
+static int	lmp_wave(uint8_t wave, uint8_t pos, unsigned int depth, unsigned int shift)
+{
+	int w;
+
+	wave &= 3;
+	w = lmp_waves[(wave > 2) ? 2 : wave][pos & 63];
+	return (w < 0) ? -((-w*depth) >> shift) : ((w*depth) >> shift);
+}
+
+static void	lmp_set_volume(mpschan_t *ch, int vol)
+{
+	if (vol > 0x40)
+		vol = 0x40;
+	if (vol < 0)
+		vol = 0;
+	ch->volume = ch->vol = vol;
+}
+
+/* Slide the pitch, stopping at the end of the range portamento clamps to */
+static void	lmp_slide_pitch(mps_t *mps, mpschan_t *ch, int delta)
+{
+	int pitch = ch->pitch + delta;
+
+	if (delta < 0 && pitch < PERIOD_MIN)
+		pitch = PERIOD_MIN;
+	if (delta > 0 && pitch > PERIOD_MAX)
+		pitch = PERIOD_MAX;
+	ch->pitch = pitch;
+	ch->phaseinc = lmp_pi_from_pitch(mps, pitch);
+}
+
+/* Speed and depth nibbles of 4xy/7xy; 0 keeps the last */
+static uint8_t	lmp_wave_param(uint8_t last, uint8_t val)
+{
+	return ((val & 0xf0) ? (val & 0xf0) : (last & 0xf0)) |
+		((val & 0x0f) ? (val & 0x0f) : (last & 0x0f));
+}
+
+/* Start a note, of an instrument (1-based, or 0 for the channel's last) */
+static void	lmp_note_on(mps_t *mps, int chan, uint8_t inst, uint16_t freq)
+{
+	const lmp_module_t *mod = mps->mod;
+	mpschan_t *ch = &mps->cs[chan];
+
+	ch->on = 1;
+	mps->active |= 1U << chan;
+	STAT(mps->stats.notes++);
+
+	/* inst = 0 means last, and *can* play a note.
+	 * Also uses current volume of channel.
+	 */
+	if (inst) {
+		ch->inst = inst-1;
+		lmp_set_volume(ch, mod->inst[inst-1].default_volume);
 	}
+	/* Else, if inst=0 it stays at current channel volume and instrument. */
+	inst = ch->inst;
+
+	ch->sample = mod->inst[inst].sample;
+	ch->pos = 0;
+	/* Note len, repeat_pos and repeat_end are fixed-point/avec fraction */
+	ch->len = mod->inst[inst].len << SAMP_FP_SPLIT;
+	if (mod->inst[inst].repeat_len != 1*2) {
+		ch->looping = 1;
+		ch->repeat_pos = mod->inst[inst].repeat_pos << SAMP_FP_SPLIT;
+		ch->repeat_end = (mod->inst[inst].repeat_pos +
+				  mod->inst[inst].repeat_len) << SAMP_FP_SPLIT;
+	} else {
+		ch->looping = 0;
+	}
+
+	ch->phaseinc = lmp_pi_from_pitch(mps, freq);
+	ch->pitch = freq;
+
+	/* The waveforms restart, unless E4x/E7x said otherwise: */
+	if (!(ch->waves & 0x04))
+		ch->vibrato_pos = 0;
+	if (!(ch->waves & 0x40))
+		ch->tremolo_pos = 0;
 }
 
-static void lmp_process_command(mps_t *mps, int chan, uint8_t command, uint8_t val)
+static void lmp_process_command(mps_t *mps, int chan, uint8_t command, uint8_t val,
+				unsigned int row)
 {
+	mpschan_t *ch = &mps->cs[chan];
+
 	switch (command) {
 		case 0: { 	/* Arpeggio */
-			if (val != 0) {
-				MPDBG(1, "Unsupported effect: Arpeggio %02x\n", val);
+			if (val != 0 && ch->pitch) {
+				ch->effect = command;
+				ch->effect_param = val;
+				ch->note = lmp_note_from_period(ch->pitch);
 			}
 		} break;
 
 		case 1:
 		case 2: { 	/* Portamento up/down: */
-			mps->cs[chan].effect = command;
-			mps->cs[chan].effect_param = val;
+			ch->effect = command;
+			ch->effect_param = val;
 			MPDBG(2, "Portamento: %d %02x\n", command, val);
 		} break;
 
-		case 10: { 	/* Volume slide */
-			/* Signed parameter?
-			 * Clamp volume to 0-64
-			 */
-			int8_t v = (int8_t)val;
-			int vol = mps->cs[chan].vol;
-			vol += v;
-			if (vol > 0x40)
-				vol = 0x40;
-			if (vol < 0)
-				vol = 0;
-			mps->cs[chan].vol = vol;
+		case 3: { 	/* Tone portamento, to the note given with it */
+			if (val)
+				ch->porta_speed = val;
+			ch->effect = command;
+		} break;
+
+		case 4: { 	/* Vibrato */
+			ch->vibrato = lmp_wave_param(ch->vibrato, val);
+			ch->effect = command;
+		} break;
+
+		case 5:		/* Tone portamento/vibrato carrying on, plus volume slide */
+		case 6:
+		case 10: { 	/* Volume slide, per tick */
+			ch->effect = command;
+			ch->effect_param = val;
+		} break;
+
+		case 7: { 	/* Tremolo */
+			ch->tremolo = lmp_wave_param(ch->tremolo, val);
+			ch->effect = command;
 		} break;
 
 		case 11: { 	/* Position jump (sequence) */
@@ -247,9 +1020,7 @@ static void lmp_process_command(mps_t *mps, int chan, uint8_t command, uint8_t v
 		} break;
 
 		case 12: { 	/* Volume */
-			if (val > 0x40)
-				val = 0x40;
-			mps->cs[chan].vol = val;
+			lmp_set_volume(ch, val);
 		} break;
 
 		case 13: { 	/* Pattern break to row XY in next pattern */
@@ -273,7 +1044,7 @@ static void lmp_process_command(mps_t *mps, int chan, uint8_t command, uint8_t v
 			if (val >= 0x20) {
 				if (mps->support_tempo) {
 					mps->tempo = val;
-					mps->samples_per_tick = lmp_samps_from_tempo(mps->tempo);
+					mps->samples_per_tick = lmp_samps_from_tempo(mps, mps->tempo);
 					MPDBG(2, "Set tempo %02x\n", val);
 				} else {
 					MPDBG(1, "Unsupported effect: Set tempo %02x\n", val);
@@ -281,47 +1052,203 @@ static void lmp_process_command(mps_t *mps, int chan, uint8_t command, uint8_t v
 			}
 		} break;
 
-		case 14: { 	/* Filter/extended */
-			MPDBG(1, "Unsupported effect: Filter cmd %02x\n", val);
-		} break;
+		case 14: { 	/* Extended */
+			int x = val & 0xf;
 
-		default:
-			MPDBG(1, "Unsupported effect: %x:%02x\n", command, val);
-			break; 	/* Do nothing */
-	}
-}
+			switch (val >> 4) {
+				case 1: /* Fine portamento up/down */
+				case 2:
+					if (ch->pitch)
+						lmp_slide_pitch(mps, ch, ((val >> 4) == 1) ? -x : x);
+					break;
 
-/* Returns "done" */
-static int lmp_tick(mps_t *mps)
-{
-	/* This is a tick event.  1 in N (tempo) ticks leads to moving
-	 * the pattern onto the next row.  Initially, a tick == 50Hz (for tempo 125).
-	 */
-	if (mps->tick_counter > 1) { /* Can speed be 0? */
-		/* Process "inter-note" effects, like portamento
-		 * which are applied on a non-note intermediate tick:
-		 */
-		for (int chan = 0; chan < 4; chan++) {
-			switch (mps->cs[chan].effect) {
-				case 1: /* Fall through */
-				case 2:
-					if (mps->cs[chan].effect == 1) {
-						mps->cs[chan].pitch -= mps->cs[chan].effect_param;
-						if (mps->cs[chan].pitch < 113)
-							mps->cs[chan].pitch = 113;
+				case 3:
+					ch->glissando = x;
+					break;
+
+				case 4: /* Vibrato/tremolo waveform */
+					ch->waves = (ch->waves & 0xf0) | x;
+					break;
+				case 7:
+					ch->waves = (ch->waves & 0x0f) | (x << 4);
+					break;
+
+				case 6: /* Pattern loop: E60 marks the start, E6x goes back x times */
+					if (x == 0) {
+						mps->loop_row = row;
 					} else {
-						mps->cs[chan].pitch += mps->cs[chan].effect_param;
-						if (mps->cs[chan].pitch > 856)
-							mps->cs[chan].pitch = 856;
+						if (mps->loop_count == 0)
+							mps->loop_count = x;
+						else
+							mps->loop_count--;
+						if (mps->loop_count)
+							mps->pos_pattern = mps->loop_row;
 					}
-					mps->cs[chan].phaseinc = lmp_pi_from_pitch(mps->cs[chan].pitch);
 					break;
 
-				case 0xff:
+				case 10: /* Fine volume slide up/down */
+					lmp_set_volume(ch, ch->volume + x);
+					break;
+				case 11:
+					lmp_set_volume(ch, ch->volume - x);
+					break;
+
+				case 12: /* Note cut, at tick x */
+					if (x == 0)
+						lmp_set_volume(ch, 0);
+					/* Fall through */
+				case 9:	 /* Retrigger every x ticks */
+				case 13: /* Note delay by x ticks (held back by lmp_tick()) */
+					ch->effect = command;
+					ch->effect_param = val;
+					break;
+
+				case 14: /* Pattern delay by x rows */
+					if (mps->pattern_delay == 0)
+						mps->pattern_delay = x;
+					break;
+
+				case 8:	 /* Sync, reported as an event */
+					break;
+
 				default:
+					MPDBG(1, "Unsupported effect: E%02x\n", val);
 					break;
 			}
-		}
+		} break;
+
+		default:
+			MPDBG(1, "Unsupported effect: %x:%02x\n", command, val);
+			break; 	/* Do nothing */
+	}
+}
+
+static void	lmp_volume_slide(mpschan_t *ch, uint8_t val)
+{
+	if (val & 0xf0)
+		lmp_set_volume(ch, ch->volume + (val >> 4));
+	else
+		lmp_set_volume(ch, ch->volume - (val & 0xf));
+}
+
+/* Apply a channel's effect for an "inter-note" tick (1 to speed-1 in the row) */
+static void	lmp_tick_effect(mps_t *mps, int chan, unsigned int tick)
+{
+	mpschan_t *ch = &mps->cs[chan];
+	unsigned int y = ch->effect_param & 0xf;
+
+	switch (ch->effect) {
+		case 0: { 	/* Arpeggio: the note, then +x, +y semitones */
+			unsigned int n = ch->note;
+
+			if (tick % 3 == 0) {
+				ch->phaseinc = lmp_pi_from_pitch(mps, ch->pitch);
+				break;
+			}
+			n += (tick % 3 == 1) ? (ch->effect_param >> 4) : y;
+			if (n >= NUM_NOTES)
+				n = NUM_NOTES - 1;
+			ch->phaseinc = lmp_pi_from_pitch(mps, lmp_note_periods[n]);
+		} break;
+
+		case 1:
+			lmp_slide_pitch(mps, ch, -ch->effect_param);
+			break;
+		case 2:
+			lmp_slide_pitch(mps, ch, ch->effect_param);
+			break;
+
+		case 5:
+			lmp_volume_slide(ch, ch->effect_param);
+			/* Fall through */
+		case 3: {
+			int p = ch->pitch, target = ch->porta_target;
+
+			if (!target || !p || p == target)
+				break;
+			if (p < target) {
+				p += ch->porta_speed;
+				if (p > target)
+					p = target;
+			} else {
+				p -= ch->porta_speed;
+				if (p < target)
+					p = target;
+			}
+			ch->pitch = p;
+			ch->phaseinc = lmp_pi_from_pitch(mps, ch->glissando ?
+							 lmp_note_periods[lmp_note_from_period(p)] : p);
+		} break;
+
+		case 6:
+			lmp_volume_slide(ch, ch->effect_param);
+			/* Fall through */
+		case 4: {
+			int p = ch->pitch + lmp_wave(ch->waves, ch->vibrato_pos,
+						     ch->vibrato & 0xf, 7);
+
+			if (ch->pitch)
+				ch->phaseinc = lmp_pi_from_pitch(mps, (p < 1) ? 1 : p);
+			ch->vibrato_pos = (ch->vibrato_pos + (ch->vibrato >> 4)) & 63;
+		} break;
+
+		case 7: {
+			int v = ch->volume + lmp_wave(ch->waves >> 4, ch->tremolo_pos,
+						      ch->tremolo & 0xf, 6);
+
+			ch->vol = (v < 0) ? 0 : (v > 0x40) ? 0x40 : v;
+			ch->tremolo_pos = (ch->tremolo_pos + (ch->tremolo >> 4)) & 63;
+		} break;
+
+		case 10:
+			lmp_volume_slide(ch, ch->effect_param);
+			break;
+
+		case 14:
+			switch (ch->effect_param >> 4) {
+				case 9:
+					if (y && tick % y == 0 && ch->pitch)
+						lmp_note_on(mps, chan, 0, ch->pitch);
+					break;
+				case 12:
+					if (tick == y)
+						lmp_set_volume(ch, 0);
+					break;
+				case 13:
+					if (tick == y && ch->delay_period) {
+						lmp_note_on(mps, chan, ch->delay_inst, ch->delay_period);
+						ch->delay_period = 0;
+						if (FEATURE_BUILT(EVENTS) && mps->events)
+							lmp_event(mps, LMP_EVENT_NOTE, ch->delay_pos,
+								  ch->delay_row, chan, ch->inst, 0);
+					}
+					break;
+			}
+			break;
+
+		case 0xff:
+		default:
+			break;
+	}
+}
+
+/* Returns "done" */
+static int lmp_tick(mps_t *mps)
+{
+	const lmp_module_t *mod = mps->mod;
+
+	/* This is a tick event.  1 in N (tempo) ticks leads to moving
+	 * the pattern onto the next row.  Initially, a tick == 50Hz (for tempo 125).
+	 */
+	STAT(mps->stats.ticks++);
+	if (mps->tick_counter > 1) { /* Can speed be 0? */
+		/* Process "inter-note" effects, like portamento
+		 * which are applied on a non-note intermediate tick:
+		 */
+		unsigned int tick = mps->speed - mps->tick_counter + 1;
+
+		for (int chan = 0; chan < mod->channels; chan++)
+			lmp_tick_effect(mps, chan, tick);
 
 		mps->tick_counter--;
 		return 0;
@@ -329,71 +1256,86 @@ static int lmp_tick(mps_t *mps)
 
 	mps->tick_counter = mps->speed;
 
-	uint8_t current_pattern = mps->sequence[mps->pos];
-	uint32_t *current_frame = &mps->patterns[256*current_pattern + 4*mps->pos_pattern];
+	if (mps->pattern_delay) {
+		/* EEx holds the row, and its effects carry on: */
+		mps->pattern_delay--;
+		for (int chan = 0; chan < mod->channels; chan++)
+			lmp_tick_effect(mps, chan, 0);
+		return 0;
+	}
+	STAT(mps->stats.rows++);
+
+	uint8_t current_pattern = mod->sequence[mps->pos];
+	const mpsnote_t *row;
+	mpsnote_t unpacked[LMP_MAX_CHANNELS];
+
+	if (mod->notes) {
+		row = &mod->notes[mod->channels*(64*mod->notes_map[current_pattern] + mps->pos_pattern)];
+	} else {
+		lmp_unpack_row(mod, current_pattern, mps->pos_pattern, unpacked);
+		row = unpacked;
+	}
 
 	/* OK, process the event at current_pattern[pos_pattern].  */
 
 	MPDBG(2, "%02d(%02d):%02d ", mps->pos, current_pattern, mps->pos_pattern);
 
-	mps->pos_pattern++;
+	unsigned int pos = mps->pos, pos_pattern = mps->pos_pattern;
 
-	for (int chan = 0; chan < 4; chan++) {
-		/* Format of the pattern's word:
-		 *
-		 * Frequency = b0[3:0],b1[7:0]
-		 * Instrument = b0[4],b2[7:4]
-		 * Command = b2[3:0]
-		 * Value = b3[7:0]
-		 */
+	if (mps->events) {
+		if (mps->new_pos)
+			lmp_event(mps, LMP_EVENT_PATTERN, pos, pos_pattern, 0, current_pattern, 0);
+		lmp_event(mps, LMP_EVENT_ROW, pos, pos_pattern, 0, 0, 0);
+	}
 
-		/* FIXME: This masking is a bit gross, as it was written for LE
-		 * then bodged for BE...  Could be cleaned up!
-		 */
-                uint32_t note = host_to_LE32(current_frame[chan]);
-		uint8_t val = note >> 24;
-		uint8_t inst = ((note >> 20) & 0xf) | (note & 0x10);
-		uint16_t freq = ((note << 8) & 0xf00) | ((note >> 8) & 0xff);
-		uint8_t command = (note >> 16) & 0xf;
+	mps->pos_pattern++;
+
+	for (int chan = 0; chan < mod->channels; chan++) {
+		mpschan_t *ch = &mps->cs[chan];
+		uint8_t val = row[chan].val;
+		uint8_t inst = row[chan].inst;
+		uint16_t freq = row[chan].period;
+		uint8_t command = row[chan].command;
 
 		MPDBG(3, "  %04d %02d %x%02x", freq, inst, command, val);
 
-		/* Reset inter-note effects: */
-		mps->cs[chan].effect = 0xff;
+		/* Reset inter-note effects, and undo any vibrato/tremolo: */
+		if (ch->effect != 0xff && ch->pitch)
+			ch->phaseinc = lmp_pi_from_pitch(mps, ch->pitch);
+		ch->vol = ch->volume;
+		ch->effect = 0xff;
 
 		/* Play a note? */
 		if (freq &&
-		    (inst <= (mps->thirtyone ? 31 : 15))) {
-			mps->cs[chan].on = 1;
-
-			/* inst = 0 means last, and *can* play a note.
-			 * Also uses current volume of channel.
-			 */
-			if (inst) {
-				mps->cs[chan].inst = inst-1;
-				mps->cs[chan].vol = mps->inst[inst-1].default_volume;
-			}
-			/* Else, if inst=0 it stays at current channel volume and instrument. */
-			inst = mps->cs[chan].inst;
-
-			mps->cs[chan].sample = mps->inst[inst].sample;
-			mps->cs[chan].pos = 0;
-			/* Note len, repeat_pos and repeat_end are fixed-point/avec fraction */
-			mps->cs[chan].len = mps->inst[inst].len << SAMP_FP_SPLIT;
-			if (mps->inst[inst].repeat_len != 1*2) {
-				mps->cs[chan].looping = 1;
-				mps->cs[chan].repeat_pos = mps->inst[inst].repeat_pos << SAMP_FP_SPLIT;
-				mps->cs[chan].repeat_end = (mps->inst[inst].repeat_pos +
-							    mps->inst[inst].repeat_len) << SAMP_FP_SPLIT;
+		    (inst <= (mod->thirtyone ? 31 : 15))) {
+			if (command == 3 || command == 5) {
+				/* Tone portamento slides to it instead */
+				ch->porta_target = freq;
+				if (inst)
+					lmp_set_volume(ch, mod->inst[inst-1].default_volume);
 			} else {
-				mps->cs[chan].looping = 0;
+				if (command == 14 && (val >> 4) == 13 && (val & 0xf)) {
+					/* Delayed, until a tick of the row (and
+					 * reported then):
+					 */
+					ch->delay_inst = inst;
+					ch->delay_period = freq;
+					ch->delay_pos = pos;
+					ch->delay_row = pos_pattern;
+				} else {
+					lmp_note_on(mps, chan, inst, freq);
+					if (FEATURE_BUILT(EVENTS) && mps->events)
+						lmp_event(mps, LMP_EVENT_NOTE, pos, pos_pattern, chan,
+							  inst ? inst-1 : ch->inst, 0);
+				}
 			}
-
-			mps->cs[chan].phaseinc = lmp_pi_from_pitch(freq);
-			mps->cs[chan].pitch = freq;
 		}
 
-		lmp_process_command(mps, chan, command, val);
+		if (FEATURE_BUILT(EVENTS) && mps->events && (command == 8 || (command == 14 && (val >> 4) == 8)))
+			lmp_event(mps, LMP_EVENT_SYNC, pos, pos_pattern, chan,
+				  (command == 8) ? val : (val & 0xf), command);
+
+		lmp_process_command(mps, chan, command, val, pos_pattern);
 	}
 	MPDBG(2, "\n");
 
@@ -405,9 +1347,16 @@ static int lmp_tick(mps_t *mps)
 		MPDBG(1, "Pos %d\n", mps->pos);
 	}
 
-	if (mps->pos >= mps->length) {
+	/* Rows are sequential within a position, unless something jumped: */
+	mps->new_pos = (mps->pos != pos || mps->pos_pattern == 0);
+	if (mps->pos != pos)
+		mps->loop_row = 0;
+
+	if (mps->pos >= mod->length) {
 		MPDBG(1, "LOOPED\n");
 		mps->pos = 0;
+		if (FEATURE_BUILT(EVENTS) && mps->events && mps->song_loop)
+			lmp_event(mps, LMP_EVENT_LOOP, 0, mps->pos_pattern, 0, 0, 0);
 
 		/* Done (FIXME: a little early, gotta play the last note...)
 		 * Loop detection is crude: go off end of sequence, or B to 0.
@@ -419,251 +1368,2050 @@ static int lmp_tick(mps_t *mps)
 	return 0;
 }
 
-static void	lmp_render_samples(mps_t *mps, int16_t csamp[4])
+////////////////////////////////////////////////////////////////////////////////
+/* Mixing kernels
+ *
+ * lmp_mix_run() mixes one voice into acc[] in groups of 4 (or 8) frames,
+ * for as long as the group's final position doesn't pass 'bound'.  If
+ * 'store' is set, acc[] is written rather than added to.  That
+ * means no end-of-sample or loop event can happen within it, and the next
+ * instrument sample is always in range.  It returns the number of frames
+ * mixed, and the scalar code in lmp_render_voice() handles the rest.  The
+ * results are identical to the scalar code.
+ *
+ * Each frame is a linear interpolation of a pair of 8-bit samples, which is
+ * a multiply-accumulate of (s1, s2)*256 by (1-frac, frac):  this is a
+ * pmaddwd/SMLAD, with the pair loaded as one halfword.  Fetching the pairs
+ * isn't vectorisable (there's no byte gather), so wider vectors don't buy
+ * much.
+ *
+ * (The downmix loops in the fill functions vectorise as written.)
+ */
+
+#if defined(LMP_SIMD_AVX2)
+static LMP_ALWAYS_INLINE unsigned int	lmp_mix_run(const int8_t *sample, uint32_t *posp,
+						    uint32_t phaseinc, uint32_t bound, int vol,
+						    int32_t *acc, unsigned int n, const int store)
 {
-	for (int chan = 0; chan < 4; chan++) {
-		int32_t c1, c2;
-		int32_t c = 0;;
-		if (mps->cs[chan].on) {
-			/* Linear interpolation between samples based on
-			 * fractional part of 'pos' (that is, a sample
-			 * is taken somewhere between two coarser
-			 * instrument sample points, and blended with
-			 * components of each weighted by distance). */
-			int frac = mps->cs[chan].pos & ((1 << SAMP_FP_SPLIT)-1);
-			int nfrac = (1 << SAMP_FP_SPLIT) -
-				(mps->cs[chan].pos & ((1 << SAMP_FP_SPLIT)-1));
-
-			c1 = (int)mps->cs[chan].sample[mps->cs[chan].pos >> SAMP_FP_SPLIT] * 0x100;
-			/* This might go off the end of the sample.
-			 *
-			 * Though that generally sounds fine, it's messy to access
-			 * off the end of the file given to us!
-			 */
-			if ((mps->cs[chan].pos >> SAMP_FP_SPLIT) <
-			    (mps->cs[chan].len >> SAMP_FP_SPLIT))
-				c2 = (int)mps->cs[chan].sample[(mps->cs[chan].pos >>
-								SAMP_FP_SPLIT) + 1] * 0x100;
-			else
-				c2 = c1;
+	uint32_t pos = *posp;
+	unsigned int i = 0;
+	const __m256i fmask = _mm256_set1_epi32((1 << SAMP_FP_SPLIT)-1);
+	const __m256i one = _mm256_set1_epi32(1 << SAMP_FP_SPLIT);
+	const __m256i offs = _mm256_set_epi32(7*phaseinc, 6*phaseinc, 5*phaseinc, 4*phaseinc,
+					      3*phaseinc, 2*phaseinc, phaseinc, 0);
+	const __m256i vvol = _mm256_set1_epi32(vol);
+
+	for (; (i + 8 <= n) && (pos + 8*phaseinc <= bound); i += 8) {
+		uint16_t pr[8];
+
+		for (int k = 0; k < 8; k++)
+			memcpy(&pr[k], &sample[(pos + k*phaseinc) >> SAMP_FP_SPLIT], sizeof(uint16_t));
+
+		__m128i s = _mm_cvtsi32_si128(pr[0]);
+		s = _mm_insert_epi16(s, pr[1], 1);
+		s = _mm_insert_epi16(s, pr[2], 2);
+		s = _mm_insert_epi16(s, pr[3], 3);
+		s = _mm_insert_epi16(s, pr[4], 4);
+		s = _mm_insert_epi16(s, pr[5], 5);
+		s = _mm_insert_epi16(s, pr[6], 6);
+		s = _mm_insert_epi16(s, pr[7], 7);
+		__m256i s2 = _mm256_slli_epi16(_mm256_cvtepu8_epi16(s), 8);
+
+		__m256i f = _mm256_and_si256(_mm256_add_epi32(_mm256_set1_epi32(pos), offs), fmask);
+		__m256i w = _mm256_or_si256(_mm256_slli_epi32(f, 16), _mm256_sub_epi32(one, f));
+		__m256i c = _mm256_srai_epi32(_mm256_madd_epi16(s2, w), SAMP_FP_SPLIT);
+
+		c = _mm256_madd_epi16(c, vvol);
+		c = _mm256_add_epi32(c, _mm256_srli_epi32(_mm256_srai_epi32(c, 31), 32-6));
+		c = _mm256_srai_epi32(c, 6);
+
+		if (!store)
+			c = _mm256_add_epi32(_mm256_loadu_si256((__m256i *)&acc[i]), c);
+		_mm256_storeu_si256((__m256i *)&acc[i], c);
+		pos += 8*phaseinc;
+	}
 
-			/* Linear interpolate between c1 and c2: */
-			c = ((c1 * nfrac) + (c2 * frac)) >> SAMP_FP_SPLIT;
+	*posp = pos;
+	return i;
+}
+#endif
 
-			MPDBG(5, "C%d: %08x %04x len %08x rpt_pos %08x rpt_end %08x "
-			      "(c1 %08x c2 %08x nf %08x f %08x)\n",
-			      chan,
-			      mps->cs[chan].pos,
-			      c & 0xffff, mps->cs[chan].len,
-			      mps->cs[chan].repeat_pos,
-			      mps->cs[chan].repeat_end,
-			      c1, c2, nfrac, frac);
+#if defined(LMP_SIMD_SSE2)
+static LMP_ALWAYS_INLINE unsigned int	lmp_mix_run(const int8_t *sample, uint32_t *posp,
+						    uint32_t phaseinc, uint32_t bound, int vol,
+						    int32_t *acc, unsigned int n, const int store)
+{
+	uint32_t pos = *posp;
+	unsigned int i = 0;
+	const __m128i fmask = _mm_set1_epi32((1 << SAMP_FP_SPLIT)-1);
+	const __m128i one = _mm_set1_epi32(1 << SAMP_FP_SPLIT);
+	const __m128i offs = _mm_set_epi32(3*phaseinc, 2*phaseinc, phaseinc, 0);
+	const __m128i vvol = _mm_set1_epi32(vol);
+
+	for (; (i + 4 <= n) && (pos + 4*phaseinc <= bound); i += 4) {
+		uint16_t pr[4];
+
+		for (int k = 0; k < 4; k++)
+			memcpy(&pr[k], &sample[(pos + k*phaseinc) >> SAMP_FP_SPLIT], sizeof(uint16_t));
+
+		/* Sample pairs as s16 lanes, (s1 << 8, s2 << 8): */
+		__m128i s = _mm_cvtsi32_si128(pr[0]);
+		s = _mm_insert_epi16(s, pr[1], 1);
+		s = _mm_insert_epi16(s, pr[2], 2);
+		s = _mm_insert_epi16(s, pr[3], 3);
+		s = _mm_unpacklo_epi8(_mm_setzero_si128(), s);
+
+		/* Weights as s16 lanes, (1-frac, frac): */
+		__m128i f = _mm_and_si128(_mm_add_epi32(_mm_set1_epi32(pos), offs), fmask);
+		__m128i w = _mm_or_si128(_mm_slli_epi32(f, 16), _mm_sub_epi32(one, f));
+		__m128i c = _mm_srai_epi32(_mm_madd_epi16(s, w), SAMP_FP_SPLIT);
+
+		/* c fits in 16 bits, so (c, sign)*(vol, 0) is c*vol.  Then
+		 * divide by 64, rounding towards zero like C does:
+		 */
+		c = _mm_madd_epi16(c, vvol);
+		c = _mm_add_epi32(c, _mm_srli_epi32(_mm_srai_epi32(c, 31), 32-6));
+		c = _mm_srai_epi32(c, 6);
+
+		if (!store)
+			c = _mm_add_epi32(_mm_loadu_si128((__m128i *)&acc[i]), c);
+		_mm_storeu_si128((__m128i *)&acc[i], c);
+		pos += 4*phaseinc;
+	}
 
-			/* Scale volume: */
-			c = (c * mps->cs[chan].vol) / 64;
-
-			mps->cs[chan].pos += mps->cs[chan].phaseinc;
-
-			if ((mps->cs[chan].looping < 2) &&
-			    (mps->cs[chan].pos > mps->cs[chan].len)) {
-				/* Reached very end. */
-				if (mps->cs[chan].looping == 0) {
-					/* No repeat, finish: */
-					mps->cs[chan].on = 0;
-				} else /* looping = 1 */ {
-					mps->cs[chan].looping = 2;
-				}
-			}
+	*posp = pos;
+	return i;
+}
+#endif
 
-			if ((mps->cs[chan].looping == 2) &&
-			    (mps->cs[chan].pos > mps->cs[chan].repeat_end)) {
-				mps->cs[chan].pos = mps->cs[chan].repeat_pos;
-			}
-		}
-		csamp[chan] = (int16_t)c;
+#if defined(LMP_SIMD_NEON)
+static LMP_ALWAYS_INLINE unsigned int	lmp_mix_run(const int8_t *sample, uint32_t *posp,
+						    uint32_t phaseinc, uint32_t bound, int vol,
+						    int32_t *acc, unsigned int n, const int store)
+{
+	uint32_t pos = *posp;
+	unsigned int i = 0;
+	const uint32_t offs_init[4] = { 0, phaseinc, 2*phaseinc, 3*phaseinc };
+	const uint32x4_t offs = vld1q_u32(offs_init);
+	const uint32x4_t fmask = vdupq_n_u32((1 << SAMP_FP_SPLIT)-1);
+	const int32x4_t one = vdupq_n_s32(1 << SAMP_FP_SPLIT);
+
+	for (; (i + 4 <= n) && (pos + 4*phaseinc <= bound); i += 4) {
+		int16x4_t s1 = vdup_n_s16(0), s2 = vdup_n_s16(0);
+		const int8_t *sp;
+
+		sp = &sample[pos >> SAMP_FP_SPLIT];
+		s1 = vset_lane_s16(sp[0], s1, 0);
+		s2 = vset_lane_s16(sp[1], s2, 0);
+		sp = &sample[(pos + phaseinc) >> SAMP_FP_SPLIT];
+		s1 = vset_lane_s16(sp[0], s1, 1);
+		s2 = vset_lane_s16(sp[1], s2, 1);
+		sp = &sample[(pos + 2*phaseinc) >> SAMP_FP_SPLIT];
+		s1 = vset_lane_s16(sp[0], s1, 2);
+		s2 = vset_lane_s16(sp[1], s2, 2);
+		sp = &sample[(pos + 3*phaseinc) >> SAMP_FP_SPLIT];
+		s1 = vset_lane_s16(sp[0], s1, 3);
+		s2 = vset_lane_s16(sp[1], s2, 3);
+
+		int32x4_t f = vreinterpretq_s32_u32(vandq_u32(vaddq_u32(vdupq_n_u32(pos), offs), fmask));
+		int32x4_t c = vmulq_s32(vshll_n_s16(s1, 8), vsubq_s32(one, f));
+		c = vmlaq_s32(c, vshll_n_s16(s2, 8), f);
+		c = vshrq_n_s32(c, SAMP_FP_SPLIT);
+
+		/* Scale volume, dividing by 64 rounding towards zero like C
+		 * does:
+		 */
+		c = vmulq_n_s32(c, vol);
+		c = vaddq_s32(c, vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(vshrq_n_s32(c, 31)),
+								     32-6)));
+		c = vshrq_n_s32(c, 6);
+
+		if (!store)
+			c = vaddq_s32(vld1q_s32(&acc[i]), c);
+		vst1q_s32(&acc[i], c);
+		pos += 4*phaseinc;
 	}
+
+	*posp = pos;
+	return i;
 }
+#endif
 
-static int lmp_check_for_tick(mps_t *mps)
+#if defined(LMP_SIMD_DSP)
+static LMP_ALWAYS_INLINE unsigned int	lmp_mix_run(const int8_t *sample, uint32_t *posp,
+						    uint32_t phaseinc, uint32_t bound, int vol,
+						    int32_t *acc, unsigned int n, const int store)
 {
-	if (--mps->sample_counter == 0) {
-		mps->sample_counter = mps->samples_per_tick;
-		return lmp_tick(mps);
+	uint32_t pos = *posp;
+	unsigned int i = 0;
+
+	for (; (i + 4 <= n) && (pos + 4*phaseinc <= bound); i += 4) {
+		for (int k = 0; k < 4; k++) {
+			uint16_t pair;
+			uint32_t frac = pos & ((1 << SAMP_FP_SPLIT)-1);
+
+			memcpy(&pair, &sample[pos >> SAMP_FP_SPLIT], sizeof(uint16_t));
+			/* Halfwords (s1 << 8, s2 << 8), by (1-frac, frac): */
+			uint32_t s = ((pair & 0xff00) << 16) | ((pair & 0xff) << 8);
+			uint32_t w = (frac << 16) | ((1 << SAMP_FP_SPLIT) - frac);
+			int32_t c = __smlad(s, w, 0) >> SAMP_FP_SPLIT;
+
+			if (store)
+				acc[i + k] = (c * vol) / 64;
+			else
+				acc[i + k] += (c * vol) / 64;
+			pos += phaseinc;
+		}
 	}
-	return 0;
+
+	*posp = pos;
+	return i;
 }
+#endif
 
-/* These functions render a buffer of samples from the song.
- * Return 1 if song ongoing, 0 if song ended (song is set to not loop).
- *
- * They are split out to compile-time select mono or stereo variants.
- *
- * Samples are s16; stereo outputs left-right (2 samples), mono 1 sample.
- * sample_buffer_size is in units of number of samples.
+#if INTERP_BUILT(LMP_INTERP_SINC)
+/* Lanczos (a = 4) windowed sinc, for taps -3..4 around the sample, by the
+ * top bits of the fractional position.  Q14; each phase sums to 1.0.
  */
+#define SINC_PHASES_LOG2	6
+
+static const int16_t lmp_sinc_table[1 << SINC_PHASES_LOG2][8] = {
+	{      0,      0,      0,  16384,      0,      0,      0,      0 },
+	{    -25,     80,   -226,  16377,    235,    -83,     26,      0 },
+	{    -49,    158,   -443,  16356,    478,   -168,     53,     -1 },
+	{    -71,    232,   -651,  16319,    730,   -255,     82,     -2 },
+	{    -93,    304,   -850,  16271,    990,   -345,    111,     -4 },
+	{   -113,    373,  -1040,  16207,   1257,   -436,    142,     -6 },
+	{   -132,    438,  -1220,  16130,   1533,   -529,    173,     -9 },
+	{   -149,    501,  -1390,  16038,   1815,   -623,    205,    -13 },
+	{   -165,    560,  -1551,  15933,   2105,   -719,    238,    -17 },
+	{   -180,    615,  -1703,  15817,   2401,   -816,    271,    -21 },
+	{   -193,    668,  -1845,  15685,   2703,   -913,    305,    -26 },
+	{   -205,    717,  -1977,  15540,   3012,  -1011,    339,    -31 },
+	{   -216,    762,  -2100,  15385,   3326,  -1110,    374,    -37 },
+	{   -226,    804,  -2213,  15216,   3646,  -1208,    409,    -44 },
+	{   -234,    842,  -2316,  15034,   3970,  -1307,    445,    -50 },
+	{   -241,    877,  -2410,  14841,   4299,  -1405,    480,    -57 },
+	{   -247,    908,  -2495,  14638,   4631,  -1502,    516,    -65 },
+	{   -251,    936,  -2571,  14422,   4968,  -1598,    551,    -73 },
+	{   -255,    961,  -2638,  14196,   5308,  -1693,    586,    -81 },
+	{   -257,    982,  -2695,  13960,   5650,  -1786,    620,    -90 },
+	{   -258,   1000,  -2744,  13711,   5995,  -1877,    655,    -98 },
+	{   -258,   1014,  -2785,  13458,   6341,  -1967,    688,   -107 },
+	{   -258,   1025,  -2816,  13193,   6689,  -2053,    721,   -117 },
+	{   -256,   1034,  -2840,  12919,   7038,  -2138,    753,   -126 },
+	{   -253,   1039,  -2856,  12635,   7388,  -2218,    784,   -135 },
+	{   -250,   1041,  -2863,  12347,   7737,  -2296,    813,   -145 },
+	{   -246,   1040,  -2864,  12050,   8086,  -2370,    842,   -154 },
+	{   -241,   1036,  -2857,  11746,   8434,  -2440,    869,   -163 },
+	{   -235,   1030,  -2842,  11435,   8780,  -2506,    894,   -172 },
+	{   -229,   1021,  -2821,  11119,   9124,  -2567,    918,   -181 },
+	{   -222,   1009,  -2794,  10797,   9466,  -2623,    941,   -190 },
+	{   -215,    995,  -2760,  10472,   9804,  -2674,    961,   -199 },
+	{   -207,    979,  -2720,  10140,  10140,  -2720,    979,   -207 },
+	{   -199,    961,  -2674,   9804,  10472,  -2760,    995,   -215 },
+	{   -190,    941,  -2623,   9466,  10797,  -2794,   1009,   -222 },
+	{   -181,    918,  -2567,   9124,  11119,  -2821,   1021,   -229 },
+	{   -172,    894,  -2506,   8780,  11435,  -2842,   1030,   -235 },
+	{   -163,    869,  -2440,   8434,  11746,  -2857,   1036,   -241 },
+	{   -154,    842,  -2370,   8086,  12050,  -2864,   1040,   -246 },
+	{   -145,    813,  -2296,   7737,  12347,  -2863,   1041,   -250 },
+	{   -135,    784,  -2218,   7388,  12635,  -2856,   1039,   -253 },
+	{   -126,    753,  -2138,   7038,  12919,  -2840,   1034,   -256 },
+	{   -117,    721,  -2053,   6689,  13193,  -2816,   1025,   -258 },
+	{   -107,    688,  -1967,   6341,  13458,  -2785,   1014,   -258 },
+	{    -98,    655,  -1877,   5995,  13711,  -2744,   1000,   -258 },
+	{    -90,    620,  -1786,   5650,  13960,  -2695,    982,   -257 },
+	{    -81,    586,  -1693,   5308,  14196,  -2638,    961,   -255 },
+	{    -73,    551,  -1598,   4968,  14422,  -2571,    936,   -251 },
+	{    -65,    516,  -1502,   4631,  14638,  -2495,    908,   -247 },
+	{    -57,    480,  -1405,   4299,  14841,  -2410,    877,   -241 },
+	{    -50,    445,  -1307,   3970,  15034,  -2316,    842,   -234 },
+	{    -44,    409,  -1208,   3646,  15216,  -2213,    804,   -226 },
+	{    -37,    374,  -1110,   3326,  15385,  -2100,    762,   -216 },
+	{    -31,    339,  -1011,   3012,  15540,  -1977,    717,   -205 },
+	{    -26,    305,   -913,   2703,  15685,  -1845,    668,   -193 },
+	{    -21,    271,   -816,   2401,  15817,  -1703,    615,   -180 },
+	{    -17,    238,   -719,   2105,  15933,  -1551,    560,   -165 },
+	{    -13,    205,   -623,   1815,  16038,  -1390,    501,   -149 },
+	{     -9,    173,   -529,   1533,  16130,  -1220,    438,   -132 },
+	{     -6,    142,   -436,   1257,  16207,  -1040,    373,   -113 },
+	{     -4,    111,   -345,    990,  16271,   -850,    304,    -93 },
+	{     -2,     82,   -255,    730,  16319,   -651,    232,    -71 },
+	{     -1,     53,   -168,    478,  16356,   -443,    158,    -49 },
+	{      0,     26,    -83,    235,  16377,   -226,     80,    -25 },
+};
+#endif
 
-/* Mono */
-int 	lmp_fill_buffer_mono(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size)
+/* A sample tap near the current one: outside an unguarded instrument, these
+ * are clamped to its ends.
+ */
+static LMP_ALWAYS_INLINE int	lmp_tap(const int8_t *sample, int p, int last, const int guarded)
 {
-	int done = 0;
-	/* Mix active samples remaining for this frame: */
-	for (unsigned int i = 0; i < sample_buffer_size; i++) {
-		int32_t sum = 0;
-		int16_t csamp[4];
+	if (!guarded)
+		p = (p < 0) ? 0 : (p > last) ? last : p;
+	return sample[p];
+}
 
-		lmp_render_samples(mps, csamp);
+/* A voice's level at pos (instrument samples times 256), by each of the
+ * interpolation kernels.
+ */
+static LMP_ALWAYS_INLINE int32_t	lmp_interp(const int8_t *sample, uint32_t pos,
+					   uint32_t last, const int guarded,
+					   const int interp)
+{
+	int p = pos >> SAMP_FP_SPLIT;
+	int frac = pos & ((1 << SAMP_FP_SPLIT)-1);
+	int32_t c;
+
+	if (interp == LMP_INTERP_NONE)
+		return (int)sample[p] * 0x100;
+
+	if (interp == LMP_INTERP_LINEAR) {
+		/* Linear interpolation between samples based on
+		 * fractional part of 'pos' (that is, a sample
+		 * is taken somewhere between two coarser
+		 * instrument sample points, and blended with
+		 * components of each weighted by distance). */
+		int nfrac = (1 << SAMP_FP_SPLIT) - frac;
+		int32_t c1, c2;
 
-		/* Mono, average channels: */
-		for (int chan = 0; chan < 4; chan++) {
-			sum += csamp[chan];
-		}
-		samples[i] = host_to_LE16(sum/4);
+		c1 = (int)sample[p] * 0x100;
+		/* This might go off the end of the sample.
+		 *
+		 * Though that generally sounds fine, it's messy to access
+		 * off the end of the file given to us!
+		 */
+		if (guarded || (uint32_t)p < last)
+			c2 = (int)sample[p + 1] * 0x100;
+		else
+			c2 = c1;
 
-		done |= lmp_check_for_tick(mps);
+		/* Linear interpolate between c1 and c2: */
+		return ((c1 * nfrac) + (c2 * frac)) >> SAMP_FP_SPLIT;
 	}
 
-	/* Returns true if we should keep being called... */
-	return !done;
+	if (interp == LMP_INTERP_CUBIC) {
+		/* Catmull-Rom through the samples either side, by Horner's
+		 * rule on frac.  Samples are taken times 64, so that the
+		 * products fit in 32 bits.
+		 */
+		int32_t sm1 = lmp_tap(sample, p - 1, last, guarded) * 64;
+		int32_t s0 = sample[p] * 64;
+		int32_t s1 = lmp_tap(sample, p + 1, last, guarded) * 64;
+		int32_t s2 = lmp_tap(sample, p + 2, last, guarded) * 64;
+		int32_t x = 3*(s0 - s1) + s2 - sm1;
+
+		x = ((x * frac) >> SAMP_FP_SPLIT) + 2*sm1 - 5*s0 + 4*s1 - s2;
+		x = ((x * frac) >> SAMP_FP_SPLIT) + s1 - sm1;
+		c = (s0 * 4) + ((x * frac) >> (SAMP_FP_SPLIT + 1 - 2));
+	} else {
+#if INTERP_BUILT(LMP_INTERP_SINC)
+		const int16_t *h = lmp_sinc_table[frac >> (SAMP_FP_SPLIT - SINC_PHASES_LOG2)];
+		int32_t sum = 0;
+
+		for (int k = 0; k < 8; k++)
+			sum += lmp_tap(sample, p + k - 3, last, guarded) * h[k];
+		/* Times 256, from Q14: */
+		c = sum >> 6;
+#else
+		c = 0;
+#endif
+	}
+
+	/* These overshoot, so saturate to 16 bits: */
+	if (c > 32767)
+		c = 32767;
+	else if (c < -32768)
+		c = -32768;
+	return c;
 }
 
-/* Hard stereo */
-int 	lmp_fill_buffer_stereo_hard(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size)
+/* Frames a voice plays from pos up to and including the one that takes it
+ * past bound (the end of the sample, or of its loop), after which it ends
+ * or wraps.  phaseinc mustn't be 0.
+ */
+static LMP_ALWAYS_INLINE uint32_t	lmp_run_frames(uint32_t pos, uint32_t phaseinc, uint32_t bound)
 {
-	int done = 0;
-	/* Mix active samples remaining for this frame: */
-	for (unsigned int i = 0; i < sample_buffer_size; i++) {
-		int16_t csamp[4];
+	return (pos > bound) ? 1 : (bound - pos)/phaseinc + 1;
+}
+
+/* Render n frames of one voice, adding its output into acc[].
+ *
+ * The voice's state is kept in locals for the duration of the span, and
+ * written back at the end.  If the (non-looping) sample ends, the remaining
+ * frames are left untouched.
+ *
+ * The frames are rendered in runs up to the next end or loop point, found
+ * from phaseinc, so the inner loop only fetches, interpolates and scales;
+ * the end/wrap is handled between runs.
+ *
+ * This is specialised for the interpolation kernel, for whether the
+ * instruments are in a guarded arena, where the samples around the current
+ * one can always be read, and for whether this is the first voice into
+ * acc[] (which is then written rather than added to, and zeroed after the
+ * end of the sample).
+ */
+static LMP_ALWAYS_INLINE void	lmp_render_voice(mps_t *mps, mpschan_t *ch, int32_t *acc,
+						 unsigned int n, const int interp,
+						 const int guarded, const int store)
+{
+	int8_t *sample = ch->sample;
+	uint32_t pos = ch->pos;
+	uint32_t phaseinc = ch->phaseinc;
+	uint32_t len = ch->len;
+	uint32_t last = ch->len >> SAMP_FP_SPLIT;
+	int vol = ch->vol;
+	uint8_t looping = ch->looping;
+	unsigned int i = 0;
+	STAT(unsigned int wraps = 0);
+
+	while (i < n) {
+		uint32_t bound = (looping < 2) ? len : ch->repeat_end;
+		uint32_t k = phaseinc ? lmp_run_frames(pos, phaseinc, bound) : n - i;
+		unsigned int end = (k < n - i) ? i + k : n;
+
+#ifdef LMP_SIMD
+		if (interp == LMP_INTERP_LINEAR) {
+			/* Also keeping the next sample inside the instrument: */
+			uint32_t vbound = (bound > len) ? len : bound;
+
+			i += lmp_mix_run(sample, &pos, phaseinc, vbound, vol, &acc[i], end - i, store);
+		}
+#endif
+		for (; i < end; i++) {
+			int32_t c = lmp_interp(sample, pos, last, guarded, interp);
 
-		lmp_render_samples(mps, csamp);
+			MPDBG(5, "%08x %04x len %08x rpt_pos %08x rpt_end %08x\n",
+			      pos, c & 0xffff, len, ch->repeat_pos, ch->repeat_end);
 
-		/* Stereo (hard panning):
-		 *
-		 * LRRL separation.  "Sounds rough, but it's cheap", as
-		 * they say.
-		 */
-		samples[i] = host_to_LE16((csamp[0] + csamp[3])/2);
-		i++;
-		samples[i] = host_to_LE16((csamp[1] + csamp[2])/2);
+			/* Scale volume: */
+			if (store)
+				acc[i] = (c * vol) / 64;
+			else
+				acc[i] += (c * vol) / 64;
+			pos += phaseinc;
+		}
 
-		done |= lmp_check_for_tick(mps);
+		if (pos <= bound)
+			continue;
+		if (looping == 0) {
+			/* Reached very end.  No repeat, finish: */
+			ch->on = 0;
+			if (store)
+				memset(&acc[i], 0, (n - i)*sizeof(int32_t));
+			break;
+		}
+		/* Into the loop (from its first pass), or round it again: */
+		looping = 2;
+		if (pos > ch->repeat_end) {
+			pos = ch->repeat_pos;
+			STAT(wraps++);
+		}
 	}
 
-	return !done;
+	ch->pos = pos;
+	ch->looping = looping;
+	(void)mps;		/* Only used for stats */
+	STAT(mps->stats.voice_samples += i; mps->stats.loop_wraps += wraps);
 }
 
-/* Soft stereo */
-int 	lmp_fill_buffer_stereo_soft(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size)
+static LMP_ALWAYS_INLINE void	lmp_mix_voice_interp(mps_t *mps, mpschan_t *ch, int32_t *acc,
+						     unsigned int n, int store, int guarded,
+						     const int interp)
 {
-	int done = 0;
-	/* Mix active samples remaining for this frame: */
-	for (unsigned int i = 0; i < sample_buffer_size; i++) {
-		int16_t csamp[4];
+	if (guarded) {
+		if (store)
+			lmp_render_voice(mps, ch, acc, n, interp, 1, 1);
+		else
+			lmp_render_voice(mps, ch, acc, n, interp, 1, 0);
+	} else {
+		if (store)
+			lmp_render_voice(mps, ch, acc, n, interp, 0, 1);
+		else
+			lmp_render_voice(mps, ch, acc, n, interp, 0, 0);
+	}
+}
+
+static void	lmp_mix_voice_ch(mps_t *mps, mpschan_t *ch, int32_t *acc, unsigned int n,
+				 int store, int guarded)
+{
+	switch (mps->interp) {
+#if INTERP_BUILT(LMP_INTERP_NONE)
+		case LMP_INTERP_NONE:
+			lmp_mix_voice_interp(mps, ch, acc, n, store, guarded, LMP_INTERP_NONE);
+			break;
+#endif
+#if INTERP_BUILT(LMP_INTERP_CUBIC)
+		case LMP_INTERP_CUBIC:
+			lmp_mix_voice_interp(mps, ch, acc, n, store, guarded, LMP_INTERP_CUBIC);
+			break;
+#endif
+#if INTERP_BUILT(LMP_INTERP_SINC)
+		case LMP_INTERP_SINC:
+			lmp_mix_voice_interp(mps, ch, acc, n, store, guarded, LMP_INTERP_SINC);
+			break;
+#endif
+		default:
+			lmp_mix_voice_interp(mps, ch, acc, n, store, guarded, LMP_INTERP_LINEAR);
+			break;
+	}
+}
 
-		lmp_render_samples(mps, csamp);
+#if LMP_PACK_WINDOW
+#if LMP_PACK_WINDOW % LMP_PACK_BLOCK || LMP_PACK_WINDOW < 2*LMP_PACK_BLOCK
+#error "LMP_PACK_WINDOW must be a multiple of LMP_PACK_BLOCK, of at least 2 blocks"
+#endif
 
-		/* Stereo:
-		 *
-		 * Rather than "hard" Amiga LRRL separation, blend as:
-		 * L = ((c0 + c3)*(3/4) + (c1 + c2)*(1/4))/2
-		 * R = ((c1 + c2)*(3/4) + (c0 + c3)*(1/4))/2
-		 */
-		samples[i] = host_to_LE16((((csamp[0] + csamp[3])*3) + (csamp[1] + csamp[2]))/(4*2));
-		i++;
-		samples[i] = host_to_LE16((((csamp[1] + csamp[2])*3) + (csamp[0] + csamp[3]))/(4*2));
+/* Samples past the current one that the widest kernel reads: */
+#define PACK_REACH		4
 
-		done |= lmp_check_for_tick(mps);
+/* Decode the samples from base - LMP_ARENA_FRONT into a voice's window.  Past
+ * the end of the instrument, these continue from the loop start (or are
+ * silent), as the guards in an arena do.  Moving on, the samples the
+ * last window of the same instrument already has are kept.
+ */
+static void	lmp_window_fill(const mpschan_t *ch, lmp_window_t *w, uint32_t base)
+{
+	const uint8_t *src = (const uint8_t *)ch->sample;
+	int32_t len = ch->len >> SAMP_FP_SPLIT;
+	int32_t rpos = ch->repeat_pos >> SAMP_FP_SPLIT;
+	int32_t rlen = ch->looping ? (int32_t)((ch->repeat_end - ch->repeat_pos) >> SAMP_FP_SPLIT) : 0;
+	int32_t from = (int32_t)base - LMP_ARENA_FRONT;
+	int32_t i = from;
+	int8_t block[LMP_PACK_BLOCK];
+	int32_t decoded = -1;
+
+	if (rpos >= len)
+		rlen = 0;
+	if (w->src == ch->sample && w->len == ch->len &&
+	    base > w->base && base < w->base + LMP_PACK_WINDOW) {
+		unsigned int keep = w->base + LMP_PACK_WINDOW - from;
+
+		memmove(w->data, w->data + (base - w->base), keep);
+		i += keep;
 	}
 
-	return !done;
+	for (; i < (int32_t)(base + LMP_PACK_WINDOW); i++) {
+		int32_t s = i;
+
+		if (s >= len)
+			s = rlen ? rpos + (s - len) % rlen : -1;
+		if (s < 0) {
+			w->data[i - from] = 0;
+			continue;
+		}
+		if (s / LMP_PACK_BLOCK != decoded) {
+			decoded = s / LMP_PACK_BLOCK;
+			lmp_unpack_block(block, src + decoded*LMP_PACK_BLOCK_BYTES);
+		}
+		w->data[i - from] = block[s % LMP_PACK_BLOCK];
+	}
+
+	w->src = ch->sample;
+	w->len = ch->len;
+	w->base = base;
 }
 
+/* Mix a voice playing a packed instrument from its window, as if from an
+ * arena.  It's mixed in pieces that end where it would read past the
+ * window, or at the end/loop point (after which it jumps), each relative to
+ * the window's base; the window is refilled before each as needed.
+ */
+static void	lmp_mix_packed(mps_t *mps, mpschan_t *ch, lmp_window_t *w, int32_t *acc,
+			       unsigned int n, int store)
+{
+	while (n) {
+		uint32_t p = ch->pos >> SAMP_FP_SPLIT;
+		int8_t *sample = ch->sample;
+		uint32_t k = n;
+
+		if (w->src != sample || w->len != ch->len ||
+		    p < w->base || p >= w->base + LMP_PACK_WINDOW - PACK_REACH)
+			lmp_window_fill(ch, w, p & ~(LMP_PACK_BLOCK - 1));
+
+		uint32_t off = w->base << SAMP_FP_SPLIT;
+
+		if (ch->phaseinc) {
+			uint32_t bound = (ch->looping < 2) ? ch->len : ch->repeat_end;
+			uint32_t limit = (w->base + LMP_PACK_WINDOW - PACK_REACH) << SAMP_FP_SPLIT;
+			uint32_t kb = lmp_run_frames(ch->pos, ch->phaseinc, bound);
+			uint32_t kw = (limit - ch->pos - 1)/ch->phaseinc + 1;
+
+			if (kb < k)
+				k = kb;
+			if (kw < k)
+				k = kw;
+		}
 
-////////////////////////////////////////////////////////////////////////////////
+		/* Relative to the window, which the loop can start before
+		 * (wrapping around, and back on the way out).  Its end might
+		 * be before the window too, if the voice is yet to reach the
+		 * end, when it passes it straight away.
+		 */
+		uint32_t repeat_end = ch->repeat_end;
+
+		ch->sample = w->data + LMP_ARENA_FRONT;
+		ch->pos -= off;
+		ch->len -= off;
+		ch->repeat_pos -= off;
+		ch->repeat_end = (repeat_end < off) ? 0 : repeat_end - off;
+		lmp_mix_voice_ch(mps, ch, acc, k, store, 1);
+		ch->sample = sample;
+		ch->pos += off;
+		ch->len += off;
+		ch->repeat_pos += off;
+		ch->repeat_end = repeat_end;
+
+		acc += k;
+		n -= k;
+		if (!ch->on) {
+			if (store)
+				memset(acc, 0, n*sizeof(int32_t));
+			break;
+		}
+	}
+}
+#endif
 
-#ifdef LMP_TEST_MAIN
+static void	lmp_mix_voice(mps_t *mps, int chan, int32_t *acc, unsigned int n, int store)
+{
+	mpschan_t *ch = &mps->cs[chan];
 
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <fcntl.h>
-#include <sys/stat.h>
+#if LMP_PACK_WINDOW
+	if (mps->mod->packed)
+		lmp_mix_packed(mps, ch, &mps->window[chan], acc, n, store);
+	else
+#endif
+		lmp_mix_voice_ch(mps, ch, acc, n, store, mps->mod->guarded);
 
-#define OUTPUT_BUFFERSIZE	1024	/* In samples */
+	if (!ch->on)
+		mps->active &= ~(1U << chan);
+}
 
-/* Simple test, renders a MOD into raw samples.
- *
- * >  lmp my_amazing_song.mod output.raw
- *
- * Convert the output with something like:
- *	sox -t s16 -r 44100 -c 2 --endian little output.raw output.wav
- * (Or, play -t s16 -r 44100 -c 2 --endian little output.raw)
+/* Move a voice on by n frames without mixing it, leaving it exactly where
+ * lmp_render_voice() would:  the steps to the next end/loop point are
+ * counted, rather than taken, and whole trips around a loop are skipped.
  */
-int 	main(int argc, char *argv[])
+static void	lmp_advance_voice(mpschan_t *ch, uint32_t n)
 {
-	int ifd, ofd;
-	char *ifile, *ofile;
-	struct stat sb;
-	uint8_t *modfile;
-	unsigned int modlen;
-	int r;
+	uint32_t pos = ch->pos;
+	uint32_t phaseinc = ch->phaseinc;
 
-	if (argc != 3) {
-		fprintf(stderr, "Syntax: %s  <infile.mod> <outfile.raw>\n",
-			argv[0]);
-		return 1;
-	}
-	ifile = argv[1];
-	ofile = argv[2];
+	if (!phaseinc)
+		return;
 
-	/* Load input file (module) fully: */
-	ifd = open(ifile, O_RDONLY);
-	if (ifd < 0) {
-		perror("Can't open input");
-		return 1;
-	}
-	fstat(ifd, &sb);
+	while (n) {
+		uint32_t bound = (ch->looping < 2) ? ch->len : ch->repeat_end;
+		/* Steps until pos passes the bound: */
+		uint32_t k = lmp_run_frames(pos, phaseinc, bound);
 
-	modlen = sb.st_size;
-	printf("Allocating %d bytes for '%s'\n", modlen, ifile);
-	modfile = malloc(modlen);
-	if (!modfile) {
-		fprintf(stderr, "Can't alloc %d!\n", modlen);
-		return 1;
+		if (n < k) {
+			pos += n*phaseinc;
+			break;
+		}
+		pos += k*phaseinc;
+		n -= k;
+
+		if (ch->looping == 0) {
+			ch->on = 0;
+			break;
+		} else if (ch->looping == 1) {
+			ch->looping = 2;
+			if (pos > ch->repeat_end)
+				pos = ch->repeat_pos;
+		} else {
+			/* From the loop start, it wraps every so many steps: */
+			pos = ch->repeat_pos;
+			n %= (ch->repeat_end - pos)/phaseinc + 1;
+		}
 	}
-	r = read(ifd, modfile, modlen);
-	if (r != modlen) {
-		/* Lazy */
-		fprintf(stderr, "Short read (%d)\n", r);
-		return 1;
+
+	ch->pos = pos;
+}
+
+/* Move the live voices of a mask on by n frames without mixing them */
+static void	lmp_skip_voices(mps_t *mps, uint32_t live, unsigned int n)
+{
+	for (int chan = 0; live; chan++, live >>= 1) {
+		if (!(live & 1))
+			continue;
+		lmp_advance_voice(&mps->cs[chan], n);
+		if (!mps->cs[chan].on)
+			mps->active &= ~(1U << chan);
 	}
-	close(ifd);
+}
 
-	ofd = open(ofile, O_CREAT | O_RDWR | O_TRUNC, 0644);
-	if (ofd < 0) {
-		perror("Can't open output");
-		return 1;
+/* Render n frames, which must not cross a tick.  The channels are mixed
+ * one at a time into the left/right accumulators (LRRL, repeating for more
+ * than 4 channels), or all into the left one if right is NULL (mono).
+ *
+ * Only live voices are visited, and muted ones (LMP_OPT_MUTE) are only moved
+ * on.  The first on each side stores and the rest accumulate, so an
+ * accumulator is only cleared if no voice lands in it.  Returns 0 if there
+ * were no live voices at all, in which case the accumulators aren't touched.
+ */
+static int	lmp_render_span(mps_t *mps, int32_t *left, int32_t *right, unsigned int n)
+{
+	uint32_t live = mps->active & ~mps->mute;
+	int lstore = 1, rstore = 1;
+
+	if (mps->active & mps->mute)
+		lmp_skip_voices(mps, mps->active & mps->mute, n);
+	if (!live)
+		return 0;
+
+	for (int chan = 0; live; chan++, live >>= 1) {
+		if (!(live & 1))
+			continue;
+		if (right && ((chan & 3) == 1 || (chan & 3) == 2)) {
+			lmp_mix_voice(mps, chan, right, n, rstore);
+			rstore = 0;
+		} else {
+			lmp_mix_voice(mps, chan, left, n, lstore);
+			lstore = 0;
+		}
 	}
 
-	/* Now do something! */
-	mps_t		mpstate;
-	int16_t		sample_buffer[OUTPUT_BUFFERSIZE];
+	if (lstore)
+		memset(left, 0, n*sizeof(int32_t));
+	if (right && rstore)
+		memset(right, 0, n*sizeof(int32_t));
+	return 1;
+}
 
-	lmp_init(&mpstate, modfile);
-	lmp_set_option(&mpstate, LMP_OPT_LOOP, 0);
+/* At a reduced mixing rate, a mixed frame falls every 2^rate_shift output
+ * frames.  Returns how many fall in the next n.
+ */
+static unsigned int	lmp_reduced_frames(const mps_t *mps, unsigned int n)
+{
+	unsigned int first = ((1U << mps->rate_shift) - mps->sub_frame) &
+		((1U << mps->rate_shift) - 1);
 
-	/* Run till done */
-	unsigned int len = 0;
-	/* If loop detection didn't work, cap at 5 minutes: */
-	unsigned int max_len = (60*5) * (2*LMP_SAMPLERATE/OUTPUT_BUFFERSIZE);
-	int more;
-	do {
-		more = lmp_fill_buffer(&mpstate, sample_buffer, OUTPUT_BUFFERSIZE, LMP_STEREO_SOFT);
-		write(ofd, sample_buffer, OUTPUT_BUFFERSIZE*sizeof(int16_t));
-		len++;
-	} while(more && (len < max_len));
+	return (n > first) ? ((n - first - 1) >> mps->rate_shift) + 1 : 0;
+}
 
-	close(ofd);
+/* As lmp_render_span(), but mixing the voices at the reduced rate and
+ * interpolating linearly up to n output frames.  The mixed frames go at the
+ * end of the accumulators, and are spread out in place; output lags them by
+ * one mixed frame.
+ */
+static int	lmp_render_reduced(mps_t *mps, int32_t *left, int32_t *right, unsigned int n)
+{
+	const unsigned int shift = mps->rate_shift;
+	unsigned int m = lmp_reduced_frames(mps, n);
+	int32_t *acc[2] = { left, right };
+
+	/* Mono takes both sides left by lmp_advance_span(): */
+	if (!right) {
+		mps->up[0][0] += mps->up[1][0];
+		mps->up[0][1] += mps->up[1][1];
+		mps->up[1][0] = mps->up[1][1] = 0;
+	}
+	if (!(m && lmp_render_span(mps, left + n - m, right ? right + n - m : NULL, m))) {
+		/* Silence, once the last voices have been interpolated out: */
+		if (!(mps->up[0][0] | mps->up[0][1] | mps->up[1][0] | mps->up[1][1]))
+			return 0;
+		memset(left + n - m, 0, m*sizeof(int32_t));
+		if (right)
+			memset(right + n - m, 0, m*sizeof(int32_t));
+	}
+
+	for (int side = 0; side < (right ? 2 : 1); side++) {
+		int32_t *a = acc[side];
+		int32_t prev = mps->up[side][0], cur = mps->up[side][1];
+		unsigned int f = mps->sub_frame;
+
+		for (unsigned int i = 0, k = n - m; i < n; i++) {
+			if (f == 0) {
+				prev = cur;
+				cur = a[k++];
+			}
+			a[i] = prev + (((cur - prev)*(int32_t)f) >> shift);
+			f = (f + 1) & ((1U << shift) - 1);
+		}
+		mps->up[side][0] = prev;
+		mps->up[side][1] = cur;
+	}
+	return 1;
+}
+
+/* As lmp_render_span(), but only moving the voices on.  At a reduced rate,
+ * the last two mixed frames are mixed (in stereo, which mono adds up) for
+ * the interpolation to carry on from, as if all had been.
+ */
+static void	lmp_advance_span(mps_t *mps, unsigned int n)
+{
+	if (FEATURE_BUILT(RATE_SHIFT) && mps->rate_shift) {
+		unsigned int m = lmp_reduced_frames(mps, n);
+		unsigned int k = (m < 2) ? m : 2;
+		int32_t left[2], right[2];
+
+		lmp_skip_voices(mps, mps->active, m - k);
+		if (!k)
+			return;
+		if (!lmp_render_span(mps, left, right, k)) {
+			memset(left, 0, sizeof(left));
+			memset(right, 0, sizeof(right));
+		}
+		for (int side = 0; side < 2; side++) {
+			int32_t *a = side ? right : left;
+
+			mps->up[side][0] = (k == 2) ? a[0] : mps->up[side][1];
+			mps->up[side][1] = a[k - 1];
+		}
+		return;
+	}
+	lmp_skip_voices(mps, mps->active, n);
+}
+
+/* Returns the number of frames that can be rendered in one go, up to the
+ * next tick (and limited by the size of the mix accumulators).
+ */
+static unsigned int	lmp_span_length(mps_t *mps, unsigned int frames)
+{
+	unsigned int n = frames;
+
+	if (n > LMP_MIX_CHUNK)
+		n = LMP_MIX_CHUNK;
+	if (n > mps->sample_counter)
+		n = mps->sample_counter;
+	return n;
+}
+
+/* Account for n rendered frames, running the sequencer if a tick is due.
+ * Returns "done".
+ */
+static int	lmp_stream_tick(mps_t *mps);
+
+static int	lmp_span_done(mps_t *mps, unsigned int n)
+{
+	mps->sample_counter -= n;
+	mps->event_frame += n;
+	mps->sub_frame = (mps->sub_frame + n) & ((1U << mps->rate_shift) - 1);
+	if (mps->sample_counter == 0) {
+		STAT(uint32_t start = LMP_CYCLES());
+		int done;
+
+		if (FEATURE_BUILT(STREAM) && mps->stream) {
+			done = lmp_stream_tick(mps);
+		} else {
+			mps->sample_counter = mps->samples_per_tick;
+			done = lmp_tick(mps);
+		}
+		STAT(lmp_stats_tick_done(mps, LMP_CYCLES() - start));
+		return done;
+	}
+	return 0;
+}
+
+/* The mixers render a buffer of samples from the song.
+ * Return 1 if song ongoing, 0 if song ended (song is set to not loop).
+ *
+ * Samples are s16; stereo outputs left-right (2 samples), mono 1 sample.
+ * sample_buffer_size is in units of number of samples.  The s32/f32 variants
+ * instead add into a buffer of the caller's (e.g. a mix bus) scaled by gain:
+ * nothing is truncated to 16 bits, and the output scaling is folded into the
+ * gain.
+ *
+ * Rendering is done in spans between ticks, so that the sequencer isn't
+ * polled per sample.
+ *
+ * The channels are averaged, in mono, or per side (LRRL repeating for more
+ * than 4 channels).
+ *
+ * One body is instantiated (by LMP_MIXER()) for each combination of mix
+ * type and output type in LMP_BUILD_MIXERS, and within those for each
+ * channel count in LMP_SPECIALISE_CHANNELS, so that each inner loop is
+ * straight-line code that divides by a constant.
+ */
+
+/* Voices landing on each side of a stereo mix: */
+#define SIDE_CHANNELS(chans)	(((chans) + 1)/2)
+
+/* Calls fn(args, channels), with a constant channel count for common ones: */
+#define LMP_FOR_CHANNELS(mps, fn, args...)				\
+	switch ((mps)->mod->channels) {					\
+		case 4: if (LMP_SPECIALISE_CHANNELS & (1U << 4))	\
+				return fn(args, 4);			\
+			break;						\
+		case 6: if (LMP_SPECIALISE_CHANNELS & (1U << 6))	\
+				return fn(args, 6);			\
+			break;						\
+		case 8: if (LMP_SPECIALISE_CHANNELS & (1U << 8))	\
+				return fn(args, 8);			\
+			break;						\
+	}								\
+	return fn(args, (mps)->mod->channels)
+
+#define LMP_OUT_S16		0
+#define LMP_OUT_S32		1
+#define LMP_OUT_F32		2
+#define LMP_OUT_S32_LJ		3	/* The I2S formats, see lmp_fill_buffer_fmt() */
+#define LMP_OUT_S24		4
+#define LMP_OUT_SWAP		8	/* Or'd in: right first */
+
+#define OUT_TYPE(otype)		((otype) & ~LMP_OUT_SWAP)
+/* The s32/f32 outputs add into the buffer, and the rest write it: */
+#define OUT_ADDS(otype)		(OUT_TYPE(otype) == LMP_OUT_S32 || OUT_TYPE(otype) == LMP_OUT_F32)
+#define OUT_SIZE(otype)		((OUT_TYPE(otype) == LMP_OUT_S16) ? 2 : \
+				 (OUT_TYPE(otype) == LMP_OUT_S24) ? 3 : 4)
+
+#define LMP_BUILT(mix, out)						\
+	((LMP_BUILD_MIXERS & (1U << (mix))) &&				\
+	 (LMP_BUILD_MIXERS & (LMP_BUILD_S16 << OUT_TYPE(out))) &&	\
+	 (!((out) & LMP_OUT_SWAP) || (LMP_BUILD_MIXERS & LMP_BUILD_SWAP)))
+
+/* Output one sample, v being the sum of channels for it (soft-panned).  s16
+ * and s32 truncate towards zero.  The 24-bit formats keep 8 more bits of it
+ * than s16, so their top 16 bits are the s16 sample rounded down instead.
+ */
+static LMP_ALWAYS_INLINE void	lmp_mix_out(void *out, unsigned int i, int32_t v,
+					    const int otype, const int div,
+					    int64_t g, float fgain)
+{
+	if (OUT_TYPE(otype) == LMP_OUT_S16) {
+		((int16_t *)out)[i] = host_to_LE16(v/div);
+	} else if (OUT_TYPE(otype) == LMP_OUT_S32) {
+		int64_t s = v * g;
+
+		((int32_t *)out)[i] += (s + ((s >> 63) & 0xffffffff)) >> 32;
+	} else if (OUT_TYPE(otype) == LMP_OUT_S32_LJ) {
+		((int32_t *)out)[i] = (int32_t)((uint32_t)((v * 256)/div) << 8);
+	} else if (OUT_TYPE(otype) == LMP_OUT_S24) {
+		int32_t s = (v * 256)/div;
+		uint8_t *p = (uint8_t *)out + 3*i;
+
+		p[0] = s;
+		p[1] = s >> 8;
+		p[2] = s >> 16;
+	} else {
+		((float *)out)[i] += (float)v * fgain;
+	}
+}
+
+/* For s32, gain is 16.16 fixed point, where LMP_GAIN_UNITY is the same level
+ * as the s16 output.  For float, a gain of 1.0 gives full-scale s16 output as
+ * +/-1.0.
+ */
+static LMP_ALWAYS_INLINE int	lmp_mix_body(mps_t *mps, void *out,
+					     unsigned int sample_buffer_size,
+					     const lmp_mix_t mix, const int otype,
+					     int32_t gain, float fgain,
+					     const unsigned int chans)
+{
+	int32_t left[LMP_MIX_CHUNK], right[LMP_MIX_CHUNK];
+	const unsigned int spf = (mix == LMP_MONO) ? 1 : 2;
+	const unsigned int size = OUT_SIZE(otype);
+	/* Where each side goes in a frame: */
+	const unsigned int lslot = (otype & LMP_OUT_SWAP) ? 1 : 0, rslot = 1 - lslot;
+	/* What the sum of channels is divided by to give the s16 output level:
+	 * mono averages all channels, hard stereo those on each side, and soft
+	 * stereo is (3*near + far)/(4*side).
+	 */
+	const int div = (mix == LMP_MONO) ? (int)chans :
+		(mix == LMP_STEREO_HARD) ? (int)SIDE_CHANNELS(chans) : 4*(int)SIDE_CHANNELS(chans);
+	/* 32.32, rounded away from zero, so that (truncated) the unity gain
+	 * output is exactly s16's for any divisor:
+	 */
+	const int64_t g = ((int64_t)gain*65536 + ((gain < 0) ? 1 - div : div - 1))/div;
+	unsigned int frames = sample_buffer_size/spf;
+	int done = 0;
+
+	fgain /= (float)(32768*div);
+
+	if (FEATURE_BUILT(CACHE) && mps->cache) {
+		if (otype != LMP_OUT_S16)
+			lmp_cache_drop(mps);
+		else if (lmp_cache_play(mps, out, frames*spf, mix))
+			return 1;
+	}
+
+	STAT_BUFFER_START(mps);
+	mps->silent = 1;
+	mps->num_events = 0;
+	mps->event_frame = 0;
+	while (frames) {
+		unsigned int n = lmp_span_length(mps, frames);
+		int loop = 0;
+		int live = (FEATURE_BUILT(RATE_SHIFT) && mps->rate_shift) ?
+			lmp_render_reduced(mps, left, (mix == LMP_MONO) ? NULL : right, n) :
+			lmp_render_span(mps, left, (mix == LMP_MONO) ? NULL : right, n);
+
+		if (live) {
+			for (unsigned int i = 0; i < n; i++) {
+				int32_t l = left[i];
+
+				if (mix == LMP_MONO) {
+					lmp_mix_out(out, i, l, otype, div, g, fgain);
+				} else if (mix == LMP_STEREO_HARD) {
+					/* LRRL separation.  "Sounds rough,
+					 * but it's cheap", as they say.
+					 */
+					lmp_mix_out(out, 2*i + lslot, l, otype, div, g, fgain);
+					lmp_mix_out(out, 2*i + rslot, right[i], otype, div, g, fgain);
+				} else {
+					/* Rather than "hard" Amiga LRRL
+					 * separation, blend as:
+					 * L = ((c0 + c3)*(3/4) + (c1 + c2)*(1/4))/2
+					 * R = ((c1 + c2)*(3/4) + (c0 + c3)*(1/4))/2
+					 */
+					int32_t r = right[i];
+
+					lmp_mix_out(out, 2*i + lslot, (l*3) + r, otype, div, g, fgain);
+					lmp_mix_out(out, 2*i + rslot, (r*3) + l, otype, div, g, fgain);
+				}
+			}
+			mps->silent = 0;
+		} else if (!OUT_ADDS(otype)) {
+			memset(out, 0, spf*n*size);
+		}
+		if (FEATURE_BUILT(CACHE) && otype == LMP_OUT_S16 && mps->cache)
+			loop = lmp_cache_record(mps, out, spf*n, n, mix);
+		out = (uint8_t *)out + spf*n*size;
+		frames -= n;
+
+		done |= lmp_span_done(mps, n);
+		if (loop && lmp_cache_loop(mps, mix)) {
+			/* The rest comes from the cache: */
+			lmp_cache_play(mps, out, spf*frames, mix);
+			break;
+		}
+	}
+
+	STAT_BUFFER_END(mps);
+	/* Returns true if we should keep being called... */
+	return !done;
+}
+
+/* Instantiate a mixer, or a stub returning -1 if it's not to be built */
+#define LMP_MIXER(name, mix, otype, out_t)				\
+static int	name(mps_t *mps, out_t *samples,			\
+		     unsigned int sample_buffer_size,			\
+		     int32_t gain, float fgain)				\
+{									\
+	if (!LMP_BUILT(mix, otype))					\
+		return -1;						\
+	LMP_FOR_CHANNELS(mps, lmp_mix_body, mps, samples,		\
+			 sample_buffer_size, mix, otype, gain, fgain);	\
+}
+
+LMP_MIXER(lmp_mix_mono_s16,	LMP_MONO,	 LMP_OUT_S16, int16_t)
+LMP_MIXER(lmp_mix_hard_s16,	LMP_STEREO_HARD, LMP_OUT_S16, int16_t)
+LMP_MIXER(lmp_mix_soft_s16,	LMP_STEREO_SOFT, LMP_OUT_S16, int16_t)
+LMP_MIXER(lmp_mix_mono_s32,	LMP_MONO,	 LMP_OUT_S32, int32_t)
+LMP_MIXER(lmp_mix_hard_s32,	LMP_STEREO_HARD, LMP_OUT_S32, int32_t)
+LMP_MIXER(lmp_mix_soft_s32,	LMP_STEREO_SOFT, LMP_OUT_S32, int32_t)
+LMP_MIXER(lmp_mix_mono_f32,	LMP_MONO,	 LMP_OUT_F32, float)
+LMP_MIXER(lmp_mix_hard_f32,	LMP_STEREO_HARD, LMP_OUT_F32, float)
+LMP_MIXER(lmp_mix_soft_f32,	LMP_STEREO_SOFT, LMP_OUT_F32, float)
+LMP_MIXER(lmp_mix_hard_s16_swap, LMP_STEREO_HARD, LMP_OUT_S16 | LMP_OUT_SWAP, int16_t)
+LMP_MIXER(lmp_mix_soft_s16_swap, LMP_STEREO_SOFT, LMP_OUT_S16 | LMP_OUT_SWAP, int16_t)
+LMP_MIXER(lmp_mix_mono_s32lj,	LMP_MONO,	 LMP_OUT_S32_LJ, int32_t)
+LMP_MIXER(lmp_mix_hard_s32lj,	LMP_STEREO_HARD, LMP_OUT_S32_LJ, int32_t)
+LMP_MIXER(lmp_mix_soft_s32lj,	LMP_STEREO_SOFT, LMP_OUT_S32_LJ, int32_t)
+LMP_MIXER(lmp_mix_hard_s32lj_swap, LMP_STEREO_HARD, LMP_OUT_S32_LJ | LMP_OUT_SWAP, int32_t)
+LMP_MIXER(lmp_mix_soft_s32lj_swap, LMP_STEREO_SOFT, LMP_OUT_S32_LJ | LMP_OUT_SWAP, int32_t)
+LMP_MIXER(lmp_mix_mono_s24,	LMP_MONO,	 LMP_OUT_S24, uint8_t)
+LMP_MIXER(lmp_mix_hard_s24,	LMP_STEREO_HARD, LMP_OUT_S24, uint8_t)
+LMP_MIXER(lmp_mix_soft_s24,	LMP_STEREO_SOFT, LMP_OUT_S24, uint8_t)
+LMP_MIXER(lmp_mix_hard_s24_swap, LMP_STEREO_HARD, LMP_OUT_S24 | LMP_OUT_SWAP, uint8_t)
+LMP_MIXER(lmp_mix_soft_s24_swap, LMP_STEREO_SOFT, LMP_OUT_S24 | LMP_OUT_SWAP, uint8_t)
+
+int 	lmp_fill_buffer_mono(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size)
+{
+	return lmp_mix_mono_s16(mps, samples, sample_buffer_size, 0, 0);
+}
+
+int 	lmp_fill_buffer_stereo_hard(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size)
+{
+	return lmp_mix_hard_s16(mps, samples, sample_buffer_size, 0, 0);
+}
+
+int 	lmp_fill_buffer_stereo_soft(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size)
+{
+	return lmp_mix_soft_s16(mps, samples, sample_buffer_size, 0, 0);
+}
+
+/* Return as for lmp_fill_buffer(), or -1 for a bad mix type */
+int	lmp_mix_buffer_s32(mps_t *mps, int32_t *acc, unsigned int sample_buffer_size,
+			   lmp_mix_t mix_type, int32_t gain)
+{
+	switch (mix_type) {
+		case LMP_MONO:		return lmp_mix_mono_s32(mps, acc, sample_buffer_size, gain, 0);
+		case LMP_STEREO_HARD:	return lmp_mix_hard_s32(mps, acc, sample_buffer_size, gain, 0);
+		case LMP_STEREO_SOFT:	return lmp_mix_soft_s32(mps, acc, sample_buffer_size, gain, 0);
+		default:		return -1;
+	}
+}
+
+int	lmp_mix_buffer_f32(mps_t *mps, float *acc, unsigned int sample_buffer_size,
+			   lmp_mix_t mix_type, float gain)
+{
+	switch (mix_type) {
+		case LMP_MONO:		return lmp_mix_mono_f32(mps, acc, sample_buffer_size, 0, gain);
+		case LMP_STEREO_HARD:	return lmp_mix_hard_f32(mps, acc, sample_buffer_size, 0, gain);
+		case LMP_STEREO_SOFT:	return lmp_mix_soft_f32(mps, acc, sample_buffer_size, 0, gain);
+		default:		return -1;
+	}
+}
+
+#if FEATURE_BUILT(STEMS)
+/* Render each channel into a plane of its own, of s16 at the level of one
+ * voice, from one pass of the sequencer.
+ */
+int	lmp_fill_stems(mps_t *mps, int16_t *const *planes, unsigned int frames)
+{
+	int32_t acc[LMP_MIX_CHUNK];
+	unsigned int at = 0;
+	int done = 0;
+
+	if (mps->rate_shift)
+		return -1;
+	lmp_cache_drop(mps);
+
+	STAT_BUFFER_START(mps);
+	mps->silent = 1;
+	mps->num_events = 0;
+	mps->event_frame = 0;
+	while (frames) {
+		unsigned int n = lmp_span_length(mps, frames);
+		uint32_t skip = mps->active & mps->mute;
+
+		for (int chan = 0; chan < mps->mod->channels; chan++) {
+			int16_t *out = planes[chan];
+
+			if (!out) {
+				skip |= mps->active & (1U << chan);
+				continue;
+			}
+			out += at;
+			if (mps->active & ~mps->mute & (1U << chan)) {
+				lmp_mix_voice(mps, chan, acc, n, 1);
+				for (unsigned int i = 0; i < n; i++)
+					out[i] = host_to_LE16(acc[i]);
+				mps->silent = 0;
+			} else {
+				memset(out, 0, n*sizeof(int16_t));
+			}
+		}
+		lmp_skip_voices(mps, skip, n);
+		at += n;
+		frames -= n;
+		done |= lmp_span_done(mps, n);
+	}
+
+	STAT_BUFFER_END(mps);
+	return !done;
+}
+#endif
+
+/* Return as for lmp_fill_buffer(), or -1 for a bad mix type or format */
+int	lmp_fill_buffer_fmt(mps_t *mps, void *out, unsigned int sample_buffer_size,
+			    lmp_mix_t mix_type, unsigned int fmt)
+{
+	/* Mono has nothing to swap: */
+	if (mix_type == LMP_MONO)
+		fmt &= ~LMP_FMT_SWAP;
+
+	switch (fmt) {
+		case LMP_FMT_S16:
+			return lmp_fill_buffer(mps, out, sample_buffer_size, mix_type);
+		case LMP_FMT_S16 | LMP_FMT_SWAP:
+			if (mix_type == LMP_STEREO_HARD)
+				return lmp_mix_hard_s16_swap(mps, out, sample_buffer_size, 0, 0);
+			if (mix_type == LMP_STEREO_SOFT)
+				return lmp_mix_soft_s16_swap(mps, out, sample_buffer_size, 0, 0);
+			break;
+		case LMP_FMT_S32_LJ:
+			switch (mix_type) {
+				case LMP_MONO:		return lmp_mix_mono_s32lj(mps, out, sample_buffer_size, 0, 0);
+				case LMP_STEREO_HARD:	return lmp_mix_hard_s32lj(mps, out, sample_buffer_size, 0, 0);
+				case LMP_STEREO_SOFT:	return lmp_mix_soft_s32lj(mps, out, sample_buffer_size, 0, 0);
+			}
+			break;
+		case LMP_FMT_S32_LJ | LMP_FMT_SWAP:
+			if (mix_type == LMP_STEREO_HARD)
+				return lmp_mix_hard_s32lj_swap(mps, out, sample_buffer_size, 0, 0);
+			if (mix_type == LMP_STEREO_SOFT)
+				return lmp_mix_soft_s32lj_swap(mps, out, sample_buffer_size, 0, 0);
+			break;
+		case LMP_FMT_S24_PACKED:
+			switch (mix_type) {
+				case LMP_MONO:		return lmp_mix_mono_s24(mps, out, sample_buffer_size, 0, 0);
+				case LMP_STEREO_HARD:	return lmp_mix_hard_s24(mps, out, sample_buffer_size, 0, 0);
+				case LMP_STEREO_SOFT:	return lmp_mix_soft_s24(mps, out, sample_buffer_size, 0, 0);
+			}
+			break;
+		case LMP_FMT_S24_PACKED | LMP_FMT_SWAP:
+			if (mix_type == LMP_STEREO_HARD)
+				return lmp_mix_hard_s24_swap(mps, out, sample_buffer_size, 0, 0);
+			if (mix_type == LMP_STEREO_SOFT)
+				return lmp_mix_soft_s24_swap(mps, out, sample_buffer_size, 0, 0);
+			break;
+	}
+	return -1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/* Seeking */
+
+/* Play on by a number of frames without mixing.  Returns "done". */
+static int	lmp_advance(mps_t *mps, uint32_t frames)
+{
+	int done = 0;
+
+	while (frames) {
+		unsigned int n = (frames < mps->sample_counter) ? frames : mps->sample_counter;
+
+		lmp_advance_span(mps, n);
+		frames -= n;
+		done |= lmp_span_done(mps, n);
+	}
+	return done;
+}
+
+/* Run the sequencer (only) until it's about to play a row: either the first
+ * that's marked in visited[] (and marking the rows played), or target_pos/row
+ * if visited is NULL.  Returns the frame the row starts at, and the row.
+ */
+static uint32_t	lmp_sequence_to(mps_t *mps, uint8_t *visited,
+				unsigned int *target_pos, unsigned int *target_row)
+{
+	uint32_t frame = 0;
+
+	for (;;) {
+		unsigned int n = mps->sample_counter;
+
+		/* (Rows repeated by E6x/EEx don't count) */
+		if (mps->tick_counter <= 1 && !mps->loop_count && !mps->pattern_delay) {
+			unsigned int b = 64*mps->pos + mps->pos_pattern;
+
+			if (visited ? (visited[b/8] & (1 << (b % 8))) :
+			    (mps->pos == *target_pos && mps->pos_pattern == *target_row)) {
+				*target_pos = mps->pos;
+				*target_row = mps->pos_pattern;
+				return frame + n;
+			}
+			if (visited)
+				visited[b/8] |= 1 << (b % 8);
+		}
+		frame += n;
+		lmp_span_done(mps, n);
+	}
+}
+
+/* Length of the song in frames, at the player's sample rate and options,
+ * found by sequencing it (without mixing) from the start until it comes back
+ * to a row it's already played.  If loop_frame isn't NULL, it's given the
+ * frame the song then loops back to (which is the first row, for songs that
+ * just end).  Doesn't change the player.
+ */
+static uint32_t	lmp_duration(const mps_t *mps, uint32_t *loop_frame,
+			     unsigned int *pos, unsigned int *row)
+{
+	uint8_t visited[256*64/8];
+	uint32_t frames;
+	mps_t p;
+
+	lmp_player_copy(&p, mps);
+	memset(visited, 0, sizeof(visited));
+	lmp_sequencer_reset(&p);
+	frames = lmp_sequence_to(&p, visited, pos, row);
+
+	if (loop_frame) {
+		lmp_player_copy(&p, mps);
+		lmp_sequencer_reset(&p);
+		*loop_frame = lmp_sequence_to(&p, NULL, pos, row);
+	}
+	return frames;
+}
+
+uint32_t	lmp_get_duration(const mps_t *mps, uint32_t *loop_frame)
+{
+	unsigned int pos, row;
+
+	return lmp_duration(mps, loop_frame, &pos, &row);
+}
+
+#if FEATURE_BUILT(SEEK) || FEATURE_BUILT(CACHE)
+static unsigned int	lmp_snapshot_stride(const lmp_module_t *mod)
+{
+	return sizeof(lmp_snapshot_t) + mod->channels*sizeof(mpschan_t);
+}
+#endif
+
+static void	lmp_snapshot_take(const mps_t *mps, lmp_snapshot_t *snap, uint32_t frame)
+{
+	snap->frame = frame;
+	snap->pos = mps->pos;
+	snap->pos_pattern = mps->pos_pattern;
+	snap->speed = mps->speed;
+	snap->tick_counter = mps->tick_counter;
+	snap->tempo = mps->tempo;
+	snap->loop_row = mps->loop_row;
+	snap->loop_count = mps->loop_count;
+	snap->pattern_delay = mps->pattern_delay;
+	snap->sub_frame = mps->sub_frame;
+	memcpy(snap->up, mps->up, sizeof(snap->up));
+	snap->sample_counter = mps->sample_counter;
+	snap->samples_per_tick = mps->samples_per_tick;
+	snap->active = mps->active;
+	memcpy(snap->cs, mps->cs, mps->mod->channels*sizeof(mpschan_t));
+}
+
+static void	lmp_snapshot_restore(mps_t *mps, const lmp_snapshot_t *snap)
+{
+	mps->pos = snap->pos;
+	mps->pos_pattern = snap->pos_pattern;
+	mps->speed = snap->speed;
+	mps->tick_counter = snap->tick_counter;
+	mps->tempo = snap->tempo;
+	mps->loop_row = snap->loop_row;
+	mps->loop_count = snap->loop_count;
+	mps->pattern_delay = snap->pattern_delay;
+	mps->sub_frame = snap->sub_frame;
+	memcpy(mps->up, snap->up, sizeof(mps->up));
+	mps->sample_counter = snap->sample_counter;
+	mps->samples_per_tick = snap->samples_per_tick;
+	mps->active = snap->active;
+	memcpy(mps->cs, snap->cs, mps->mod->channels*sizeof(mpschan_t));
+	mps->new_pos = (snap->pos_pattern == 0);
+}
+
+#if FEATURE_BUILT(SEEK)
+/* Bytes needed for an index of this many snapshots */
+unsigned int	lmp_index_size(const mps_t *mps, unsigned int snapshots)
+{
+	return LMP_INDEX_HEADER_SIZE + snapshots*lmp_snapshot_stride(mps->mod);
+}
+
+/* Build an index of snapshots of the player, one at its current point (song
+ * start, usually) and then one at every every_rows'th row, in a buffer
+ * (aligned as for a pointer) from the caller.  This runs the sequencer
+ * without mixing, until the song ends or the buffer is full, and doesn't
+ * change the player.
+ *
+ * Returns the number of snapshots, or -1 if there's no room for one.
+ */
+int	lmp_index_build(const mps_t *mps, unsigned int every_rows, void *buffer, unsigned int size)
+{
+	lmp_index_t *idx = buffer;
+	unsigned int max;
+	unsigned int rows = 0;
+	uint32_t frame = 0;
+	mps_t p;
+	int done = 0;
+
+	if (size < lmp_index_size(mps, 1))
+		return -1;
+	if (!every_rows)
+		every_rows = 1;
+
+	idx->samplerate = mps->samplerate;
+	idx->channels = mps->mod->channels;
+	idx->stride = lmp_snapshot_stride(mps->mod);
+	max = (size - LMP_INDEX_HEADER_SIZE)/idx->stride;
+
+	lmp_player_copy(&p, mps);
+	lmp_snapshot_take(&p, LMP_INDEX_SNAPSHOT(idx, 0), 0);
+	idx->count = 1;
+	/* Only changes lmp_tick()'s return, to see where the song ends: */
+	p.song_loop = 0;
+
+	while (!done && idx->count < max) {
+		unsigned int n = p.sample_counter;
+		/* lmp_tick() processes a row when it's counted down: */
+		int row = p.tick_counter <= 1;
+
+		lmp_advance_span(&p, n);
+		done = lmp_span_done(&p, n);
+		frame += n;
+
+		if (row && (++rows % every_rows) == 0)
+			lmp_snapshot_take(&p, LMP_INDEX_SNAPSHOT(idx, idx->count++), frame);
+	}
+	idx->end = frame;
+	return idx->count;
+}
+
+/* Move the player to a frame (an output sample, or pair of samples for
+ * stereo) of the song: restore the last snapshot before it, and play on
+ * (without mixing) from there.  Rendering then carries on exactly as if
+ * every frame had been rendered (at a rate shift too).  The index must be
+ * for this module at the current sample rate, with the same options.
+ *
+ * Returns 0, or -1 if the index doesn't fit this player.
+ */
+int	lmp_seek(mps_t *mps, const lmp_index_t *idx, uint32_t frame)
+{
+	unsigned int lo = 0, hi;
+
+	if (idx->samplerate != mps->samplerate || idx->channels != mps->mod->channels ||
+	    idx->count == 0)
+		return -1;
+
+	/* Last snapshot at or before frame: */
+	hi = idx->count;
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi)/2;
+
+		if (LMP_INDEX_SNAPSHOT(idx, mid)->frame <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	lmp_cache_drop(mps);
+	lmp_snapshot_restore(mps, LMP_INDEX_SNAPSHOT(idx, lo));
+	lmp_advance(mps, frame - LMP_INDEX_SNAPSHOT(idx, lo)->frame);
+	return 0;
+}
+
+/* Move on as though frames had been rendered and thrown away: the sequencer
+ * runs a tick at a time, and the voices are stepped along (and round their
+ * loops) without mixing, so this costs about as much per tick as the
+ * sequencer does (plus two mixed frames, at a rate shift).  Returns as for
+ * lmp_fill_buffer().
+ */
+int	lmp_skip_samples(mps_t *mps, uint32_t frames)
+{
+	lmp_event_t *events = mps->events;
+	int done;
+
+	lmp_cache_drop(mps);
+	/* Nothing skipped over is reported: */
+	mps->events = NULL;
+	done = lmp_advance(mps, frames);
+	mps->events = events;
+	return !done;
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+/* Loop cache
+ *
+ * Once the song has got round to its loop row, the s16 output is recorded
+ * from there, with a snapshot of the player.  When it next gets there, if
+ * the player's state matches the snapshot then everything from here on will
+ * be the same as the recording, which is played instead (cyclically).  If
+ * not (e.g. a note still ringing from before the loop), it records again.
+ * To render live again, the player is put back to the snapshot and moved on
+ * (without mixing) by what's been played of the recording.
+ */
+
+#define CACHE_IDLE		0	/* Waiting for the loop row */
+#define CACHE_RECORDING		1
+#define CACHE_PLAYING		2
+#define CACHE_OFF		3	/* The loop didn't fit */
+
+static int	lmp_snapshot_matches(const mps_t *mps, const lmp_snapshot_t *snap)
+{
+	if (snap->pos != mps->pos || snap->pos_pattern != mps->pos_pattern ||
+	    snap->speed != mps->speed || snap->tick_counter != mps->tick_counter ||
+	    snap->tempo != mps->tempo || snap->sample_counter != mps->sample_counter ||
+	    snap->loop_row != mps->loop_row || snap->loop_count != mps->loop_count ||
+	    snap->pattern_delay != mps->pattern_delay || snap->sub_frame != mps->sub_frame ||
+	    snap->samples_per_tick != mps->samples_per_tick || snap->active != mps->active ||
+	    memcmp(snap->up, mps->up, sizeof(snap->up)))
+		return 0;
+
+	for (int chan = 0; chan < mps->mod->channels; chan++) {
+		const mpschan_t *a = &mps->cs[chan], *b = &snap->cs[chan];
+
+		if (a->on != b->on || a->vol != b->vol || a->inst != b->inst ||
+		    a->looping != b->looping || a->pitch != b->pitch ||
+		    a->effect != b->effect || a->effect_param != b->effect_param ||
+		    a->sample != b->sample || a->pos != b->pos || a->phaseinc != b->phaseinc ||
+		    a->len != b->len || a->repeat_pos != b->repeat_pos ||
+		    a->repeat_end != b->repeat_end || a->volume != b->volume ||
+		    a->note != b->note || a->porta_target != b->porta_target ||
+		    a->porta_speed != b->porta_speed || a->glissando != b->glissando ||
+		    a->vibrato != b->vibrato || a->tremolo != b->tremolo ||
+		    a->waves != b->waves || a->vibrato_pos != b->vibrato_pos ||
+		    a->tremolo_pos != b->tremolo_pos || a->delay_inst != b->delay_inst ||
+		    a->delay_period != b->delay_period)
+			return 0;
+	}
+	return 1;
+}
+
+/* Put a player where the cache has played up to */
+static void	lmp_cache_catch_up(mps_t *mps, const lmp_cache_t *c)
+{
+	lmp_snapshot_restore(mps, c->snap);
+	lmp_advance(mps, c->read/((c->mix_type == LMP_MONO) ? 1 : 2));
+}
+
+/* Something's changing the player, so render live from here on */
+static void	lmp_cache_drop(mps_t *mps)
+{
+	lmp_cache_t *c = mps->cache;
+
+	if (!FEATURE_BUILT(CACHE) || !c || c->state == CACHE_OFF)
+		return;
+	if (c->state == CACHE_PLAYING)
+		lmp_cache_catch_up(mps, c);
+	c->state = CACHE_IDLE;
+}
+
+/* Fill samples[n] from the cache, if it's playing and still can.  Returns 1
+ * if it did.
+ */
+static int	lmp_cache_play(mps_t *mps, int16_t *samples, unsigned int n, lmp_mix_t mix_type)
+{
+	lmp_cache_t *c = mps->cache;
+
+	if (c->state != CACHE_PLAYING)
+		return 0;
+	if (mix_type != c->mix_type || mps->events || !mps->song_loop) {
+		lmp_cache_drop(mps);
+		return 0;
+	}
+
+	while (n) {
+		unsigned int k = (c->length - c->read < n) ? c->length - c->read : n;
+
+		memcpy(samples, c->pcm + c->read, k*sizeof(int16_t));
+		samples += k;
+		n -= k;
+		c->read += k;
+		if (c->read == c->length)
+			c->read = 0;
+	}
+	mps->silent = 0;
+	return 1;
+}
+
+/* Keep n samples (frames frames) just rendered, if recording.  Returns 1 if
+ * the span ends with the tick that plays the loop row.
+ */
+static int	lmp_cache_record(mps_t *mps, const int16_t *samples, unsigned int n,
+				 unsigned int frames, lmp_mix_t mix_type)
+{
+	lmp_cache_t *c = mps->cache;
+
+	if (c->state == CACHE_RECORDING) {
+		if (mix_type != c->mix_type) {
+			c->state = CACHE_IDLE;
+		} else if (c->length + n > c->capacity) {
+			MPDBG(1, "Loop doesn't fit in the cache\n");
+			c->state = CACHE_OFF;
+		} else {
+			memcpy(c->pcm + c->length, samples, n*sizeof(int16_t));
+			c->length += n;
+		}
+	}
+
+	return mps->sample_counter == frames && mps->tick_counter <= 1 &&
+		mps->pos == c->pos && mps->pos_pattern == c->row;
+}
+
+/* At the loop row: play the recording if the player's back where it started,
+ * or start one.  Returns 1 if playing.
+ */
+static int	lmp_cache_loop(mps_t *mps, lmp_mix_t mix_type)
+{
+	lmp_cache_t *c = mps->cache;
+
+	if (c->state == CACHE_OFF)
+		return 0;
+	if (c->state == CACHE_RECORDING && lmp_snapshot_matches(mps, c->snap)) {
+		MPDBG(1, "Playing %u samples from the cache\n", c->length);
+		c->state = CACHE_PLAYING;
+		c->read = 0;
+		return 1;
+	}
+
+	if (!mps->song_loop || mps->events) {
+		c->state = CACHE_IDLE;
+		return 0;
+	}
+	lmp_snapshot_take(mps, c->snap, 0);
+	c->mix_type = mix_type;
+	c->length = 0;
+	c->state = CACHE_RECORDING;
+	return 0;
+}
+
+void	lmp_player_copy(mps_t *dst, const mps_t *src)
+{
+	*dst = *src;
+	dst->stream = NULL;
+	dst->cache = NULL;
+	dst->events = NULL;
+	dst->max_events = 0;
+	if (FEATURE_BUILT(CACHE) && src->cache && src->cache->state == CACHE_PLAYING)
+		lmp_cache_catch_up(dst, src->cache);
+}
+
+#if FEATURE_BUILT(CACHE)
+/* Bytes needed to cache one loop of the song (as lmp_get_duration() finds
+ * it) for a mix type.
+ */
+unsigned int	lmp_cache_size(const mps_t *mps, lmp_mix_t mix_type)
+{
+	uint32_t loop_frame, frames = lmp_get_duration(mps, &loop_frame);
+
+	return LMP_SNAPSHOT_ALIGN - 1 + lmp_snapshot_stride(mps->mod) +
+		(frames - loop_frame)*((mix_type == LMP_MONO) ? 1 : 2)*sizeof(int16_t);
+}
+
+int	lmp_cache_init(mps_t *mps, lmp_cache_t *c, void *buffer, unsigned int size)
+{
+	/* The snapshot goes first, aligned for its pointers: */
+	uintptr_t a = ((uintptr_t)buffer + LMP_SNAPSHOT_ALIGN - 1) & ~(uintptr_t)(LMP_SNAPSHOT_ALIGN - 1);
+	unsigned int used = a - (uintptr_t)buffer + lmp_snapshot_stride(mps->mod);
+	unsigned int pos, row;
+
+	if (size < used)
+		return -1;
+	lmp_cache_stop(mps);
+
+	lmp_duration(mps, NULL, &pos, &row);
+	c->pos = pos;
+	c->row = row;
+	c->snap = (lmp_snapshot_t *)a;
+	c->pcm = (int16_t *)(a + lmp_snapshot_stride(mps->mod));
+	c->capacity = (size - used)/sizeof(int16_t);
+	c->length = c->read = 0;
+	c->state = CACHE_IDLE;
+	mps->cache = c;
+	return 0;
+}
+#endif
+
+void	lmp_cache_stop(mps_t *mps)
+{
+	lmp_cache_drop(mps);
+	mps->cache = NULL;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/* Streaming */
+
+#if LMP_STREAM_TICKS & (LMP_STREAM_TICKS - 1)
+#error "LMP_STREAM_TICKS must be a power of two"
+#endif
+
+/* Run the sequencer for one tick, recording what the mixer needs of it */
+static void	lmp_stream_produce(lmp_stream_t *s, lmp_tick_t *t)
+{
+	mps_t *seq = &s->seq;
+
+	/* As lmp_span_done(): the span after a tick is the old length */
+	t->frames = seq->samples_per_tick;
+	seq->active = 0;
+	t->done = lmp_tick(seq);
+	t->trigger = seq->active;
+	memcpy(t->cs, seq->cs, seq->mod->channels*sizeof(mpschan_t));
+}
+
+/* The mixer's tick: apply the next queued one to its voices */
+static int	lmp_stream_tick(mps_t *mps)
+{
+	lmp_stream_t *s = mps->stream;
+	unsigned int tail = s->tail;
+	lmp_tick_t *t = &s->ticks[tail & (LMP_STREAM_TICKS - 1)];
+
+	if (tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) {
+		if (s->low_water) {
+			/* The sequencer's late; keep going with what's playing */
+			s->underruns++;
+			mps->sample_counter = LMP_MIX_CHUNK;
+			return 0;
+		}
+		/* Nobody else sequences, so do it here: */
+		lmp_stream_produce(s, t);
+		s->head = tail + 1;
+	}
+
+	for (int chan = 0; chan < mps->mod->channels; chan++) {
+		if (t->trigger & (1U << chan)) {
+			mps->cs[chan] = t->cs[chan];
+		} else {
+			/* Volume and pitch effects carry on in playing notes */
+			mps->cs[chan].vol = t->cs[chan].vol;
+			mps->cs[chan].phaseinc = t->cs[chan].phaseinc;
+		}
+	}
+	mps->active |= t->trigger;
+	mps->sample_counter = t->frames;
+
+	__atomic_store_n(&s->tail, tail + 1, __ATOMIC_RELEASE);
+	return t->done;
+}
+
+#if FEATURE_BUILT(STREAM)
+void	lmp_stream_init_fmt(lmp_stream_t *s, mps_t *mps, void *buffer,
+			    unsigned int buffer_size, lmp_mix_t mix_type,
+			    unsigned int format)
+{
+	lmp_cache_stop(mps);
+	s->mps = mps;
+	lmp_player_copy(&s->seq, mps);
+	s->buffer = buffer;
+	s->buffer_size = buffer_size;
+	s->mix_type = mix_type;
+	s->format = format;
+	s->low_water = NULL;
+	s->low_water_arg = NULL;
+	s->low_water_ticks = 0;
+	s->underruns = 0;
+	s->head = s->tail = 0;
+
+	mps->stream = s;
+	lmp_fill_buffer_fmt(mps, buffer, buffer_size, mix_type, format);
+}
+
+void	lmp_stream_init(lmp_stream_t *s, mps_t *mps, int16_t *buffer,
+			unsigned int buffer_size, lmp_mix_t mix_type)
+{
+	lmp_stream_init_fmt(s, mps, buffer, buffer_size, mix_type, LMP_FMT_S16);
+}
+
+void	lmp_stream_set_low_water(lmp_stream_t *s, unsigned int ticks,
+				 void (*hook)(void *arg), void *arg)
+{
+	s->low_water_ticks = ticks;
+	s->low_water_arg = arg;
+	s->low_water = hook;
+	lmp_stream_sequence(s);
+}
+
+unsigned int	lmp_stream_sequence(lmp_stream_t *s)
+{
+	unsigned int head = s->head;
+	unsigned int tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+
+	while (head - tail < LMP_STREAM_TICKS) {
+		lmp_stream_produce(s, &s->ticks[head & (LMP_STREAM_TICKS - 1)]);
+		__atomic_store_n(&s->head, ++head, __ATOMIC_RELEASE);
+		tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+	}
+	return head - tail;
+}
+
+static int	lmp_stream_fill(lmp_stream_t *s, unsigned int half)
+{
+	unsigned int n = s->buffer_size/2;
+	int more = lmp_fill_buffer_fmt(s->mps, (uint8_t *)s->buffer + half*n*LMP_FMT_BYTES(s->format),
+				       n, s->mix_type, s->format);
+
+	if (s->low_water && __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) - s->tail <=
+	    s->low_water_ticks)
+		s->low_water(s->low_water_arg);
+	return more;
+}
+
+int	lmp_on_half_transfer(lmp_stream_t *s)
+{
+	return lmp_stream_fill(s, 0);
+}
+
+int	lmp_on_full_transfer(lmp_stream_t *s)
+{
+	return lmp_stream_fill(s, 1);
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef LMP_TEST_MAIN
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define OUTPUT_BUFFERSIZE	(256*1024)	/* In samples */
+#define OUTPUT_ALIGN		4096
+#define WAV_HEADER_SIZE		44
+
+/* Renders a MOD once through, into a WAV file (or raw s16 LE if the name
+ * ends in .raw, or WAV to stdout for "-"):
+ *
+ * >  lmp [-r rate] [-m mono|hard|soft] [-t seconds] my_amazing_song.mod output.wav
+ *
+ * The module is mmapped, as the player only needs a pointer to it.  File
+ * output is mmapped too and rendered straight into; stdout gets big writes
+ * from an aligned buffer.
+ *
+ * Play raw output with something like:
+ *	play -t s16 -r 44100 -c 2 --endian little output.raw
+ */
+
+static void	put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void	put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static void	wav_header(uint8_t *h, unsigned int rate, unsigned int channels, uint32_t data_bytes)
+{
+	memcpy(h, "RIFF", 4);
+	put_le32(h + 4, WAV_HEADER_SIZE - 8 + data_bytes);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le32(h + 16, 16);			/* fmt chunk size */
+	put_le16(h + 20, 1);			/* PCM */
+	put_le16(h + 22, channels);
+	put_le32(h + 24, rate);
+	put_le32(h + 28, rate*channels*2);	/* Bytes/s */
+	put_le16(h + 32, channels*2);		/* Bytes/frame */
+	put_le16(h + 34, 16);
+	memcpy(h + 36, "data", 4);
+	put_le32(h + 40, data_bytes);
+}
+
+/* Map a module read-only, followed by zeros: the mixer can read a little
+ * beyond the end of the last sample.  Returns NULL on failure, or the
+ * mapping and its length.
+ */
+static uint8_t	*map_module(const char *path, size_t *len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat sb;
+	size_t maplen;
+	uint8_t *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Can't open input");
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < 0x43c) {
+		fprintf(stderr, "%s: not a module\n", path);
+		close(fd);
+		return NULL;
+	}
+	maplen = (sb.st_size + page - 1) & ~(size_t)(page - 1);
+	*len = maplen + page;
+
+	/* Reserve an extra page of zeros, and map the file over the start: */
+	base = mmap(NULL, *len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED ||
+	    mmap(base, sb.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		perror("Can't map input");
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return base;
+}
+
+static int	write_all(int fd, const uint8_t *buf, size_t len)
+{
+	while (len) {
+		ssize_t r = write(fd, buf, len);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static void	render(mps_t *mps, int16_t *out, uint32_t frames, unsigned int channels,
+		       lmp_mix_t mix_type)
+{
+	while (frames) {
+		uint32_t n = (frames < OUTPUT_BUFFERSIZE/channels) ? frames : OUTPUT_BUFFERSIZE/channels;
+
+		lmp_fill_buffer(mps, out, n*channels, mix_type);
+		out += n*channels;
+		frames -= n;
+	}
+}
+
+/* Render into a file mapped at its final size; returns -1 if it can't be mapped */
+static int	render_mapped(int ofd, mps_t *mps, const uint8_t *hdr, unsigned int hdr_size,
+			      uint32_t frames, unsigned int channels, lmp_mix_t mix_type)
+{
+	size_t len = hdr_size + (size_t)frames*channels*sizeof(int16_t);
+	uint8_t *out;
+
+	if (ftruncate(ofd, len) < 0)
+		return -1;
+	out = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+	if (out == MAP_FAILED)
+		return -1;
+
+	memcpy(out, hdr, hdr_size);
+	render(mps, (int16_t *)(out + hdr_size), frames, channels, mix_type);
+	munmap(out, len);
+	return 0;
+}
+
+/* Render through an aligned buffer, the first write carrying the header */
+static int	render_streamed(int ofd, mps_t *mps, const uint8_t *hdr, unsigned int hdr_size,
+				uint32_t frames, unsigned int channels, lmp_mix_t mix_type)
+{
+	uint32_t chunk = OUTPUT_BUFFERSIZE/channels;
+	uint8_t *buf = aligned_alloc(OUTPUT_ALIGN, OUTPUT_BUFFERSIZE*sizeof(int16_t) + OUTPUT_ALIGN);
+	/* Samples are aligned, with the header just before them (written
+	 * with the first chunk only):
+	 */
+	uint8_t *samples = buf + OUTPUT_ALIGN;
+	int r = 0;
+
+	if (!buf)
+		return -1;
+	memcpy(samples - hdr_size, hdr, hdr_size);
+	while (frames && !r) {
+		uint32_t n = (frames < chunk) ? frames : chunk;
+
+		render(mps, (int16_t *)samples, n, channels, mix_type);
+		r = write_all(ofd, samples - hdr_size, hdr_size + n*channels*sizeof(int16_t));
+		frames -= n;
+		hdr_size = 0;
+	}
+	free(buf);
+	return r;
+}
+
+static void	usage(const char *me)
+{
+	fprintf(stderr, "Syntax: %s [-r rate] [-m mono|hard|soft] [-i none|linear|cubic|sinc] [-t seconds] "
+		"<infile.mod> <outfile.wav|outfile.raw|->\n", me);
+	exit(1);
+}
+
+int 	main(int argc, char *argv[])
+{
+	lmp_mix_t mix_type = LMP_STEREO_SOFT;
+	unsigned int rate = LMP_SAMPLERATE;
+	unsigned int seconds = 0;
+	unsigned int interp = LMP_INTERP_LINEAR;
+	char *ifile, *ofile;
+	uint8_t *modfile;
+	size_t modlen;
+	int opt, ofd, raw, r;
+
+	while ((opt = getopt(argc, argv, "r:m:i:t:")) != -1) {
+		switch (opt) {
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'm':
+				if (!strcmp(optarg, "mono"))
+					mix_type = LMP_MONO;
+				else if (!strcmp(optarg, "hard"))
+					mix_type = LMP_STEREO_HARD;
+				else if (!strcmp(optarg, "soft"))
+					mix_type = LMP_STEREO_SOFT;
+				else
+					usage(argv[0]);
+				break;
+			case 'i':
+				if (!strcmp(optarg, "none"))
+					interp = LMP_INTERP_NONE;
+				else if (!strcmp(optarg, "linear"))
+					interp = LMP_INTERP_LINEAR;
+				else if (!strcmp(optarg, "cubic"))
+					interp = LMP_INTERP_CUBIC;
+				else if (!strcmp(optarg, "sinc"))
+					interp = LMP_INTERP_SINC;
+				else
+					usage(argv[0]);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+	ifile = argv[optind];
+	ofile = argv[optind + 1];
+	raw = strlen(ofile) > 4 && !strcmp(ofile + strlen(ofile) - 4, ".raw");
+
+	modfile = map_module(ifile, &modlen);
+	if (!modfile)
+		return 1;
+
+	/* Now do something! */
+	lmp_module_t	module;
+	mps_t		mpstate;
+	unsigned int	channels = (mix_type == LMP_MONO) ? 1 : 2;
+	uint8_t		hdr[WAV_HEADER_SIZE];
+
+	if (lmp_module_init(&module, modfile)) {
+		fprintf(stderr, "%s: can't play this module\n", ifile);
+		return 1;
+	}
+	if (interp > LMP_INTERP_LINEAR || module.packed) {
+		/* The wider kernels want guards around the instruments, and
+		 * packed ones might need unpacking:
+		 */
+		unsigned int size = lmp_arena_size(&module);
+		void *arena = malloc(size);
+
+		if (arena)
+			lmp_load_arena(&module, arena, size);
+	}
+	if (lmp_player_init(&mpstate, &module)) {
+		fprintf(stderr, "%s: can't play this module\n", ifile);
+		return 1;
+	}
+	lmp_set_option(&mpstate, LMP_OPT_SAMPLERATE, rate);
+	lmp_set_option(&mpstate, LMP_OPT_INTERP, interp);
+
+	/* Render the song once through, limited by WAV's 4GB: */
+	uint32_t frames = lmp_get_duration(&mpstate, NULL);
+	uint32_t max_frames = (0xffffffffU - WAV_HEADER_SIZE)/(channels*sizeof(int16_t));
+
+	if (seconds && (uint64_t)seconds*mpstate.samplerate < frames)
+		frames = seconds*mpstate.samplerate;
+	if (frames > max_frames)
+		frames = max_frames;
+	wav_header(hdr, mpstate.samplerate, channels, frames*channels*sizeof(int16_t));
+	fprintf(stderr, "%s: %u frames at %uHz (%u:%02u)\n", ifile, frames, mpstate.samplerate,
+	       frames/mpstate.samplerate/60, frames/mpstate.samplerate % 60);
+
+	if (!strcmp(ofile, "-")) {
+		r = render_streamed(1, &mpstate, hdr, WAV_HEADER_SIZE, frames, channels, mix_type);
+	} else {
+		ofd = open(ofile, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if (ofd < 0) {
+			perror("Can't open output");
+			return 1;
+		}
+		r = render_mapped(ofd, &mpstate, hdr, raw ? 0 : WAV_HEADER_SIZE,
+				  frames, channels, mix_type);
+		if (r < 0) {
+			/* Not mappable, e.g. a pipe: */
+			r = render_streamed(ofd, &mpstate, hdr, raw ? 0 : WAV_HEADER_SIZE,
+					    frames, channels, mix_type);
+		}
+		if (close(ofd) < 0)
+			r = -1;
+	}
+	if (r < 0) {
+		perror("Can't write output");
+		return 1;
+	}
 
+	munmap(modfile, modlen);
 	return 0;
 }
 
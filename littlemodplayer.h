@@ -3,6 +3,30 @@
 
 #include <inttypes.h>
 
+/* Most channels a module can have (up to 32); others are refused.  Sets the
+ * size of mps_t (and of streams), so the project must define it the same
+ * everywhere this is included: 4 for plain M.K. songs is smallest.
+ */
+#ifndef LMP_MAX_CHANNELS
+#define LMP_MAX_CHANNELS	8
+#endif
+
+/* Ticks a stream's sequencer can run ahead of its mixer (a power of two).
+ * Also sets the size of lmp_stream_t.
+ */
+#ifndef LMP_STREAM_TICKS
+#define LMP_STREAM_TICKS	8
+#endif
+
+/* Samples of a packed module (see lmp_pack.c) decoded at a time per voice,
+ * to play it directly: a multiple of LMP_PACK_BLOCK of at least 2 blocks
+ * (128 is plenty).  Also sets the size of mps_t, by a window per channel; 0
+ * leaves this out, and packed modules must be unpacked with lmp_load_arena().
+ */
+#ifndef LMP_PACK_WINDOW
+#define LMP_PACK_WINDOW		0
+#endif
+
 /******************************************************************************/
 /* Internal types/structs/functions: these may change */
 
@@ -14,6 +38,18 @@ typedef struct {
 	uint8_t default_volume;
 } mpsamp_t;
 
+/* A pattern note, unpacked from its 4 bytes in the MOD */
+typedef struct {
+	uint16_t period;
+	uint8_t inst;
+	uint8_t command;
+	uint8_t val;
+	uint8_t pad;
+} mpsnote_t;
+
+/* Predecoded patterns start with a map of pattern number to slot: */
+#define LMP_NOTES_MAP_SIZE	256
+
 typedef struct {
 	uint8_t on; 			// Instrument or -1
 	uint8_t vol;
@@ -22,6 +58,20 @@ typedef struct {
 	uint16_t pitch;			// From original period in song note
 	uint8_t effect;			// 0xff = no effect
 	uint8_t effect_param;
+	uint8_t volume;			// vol is this, plus any tremolo
+	uint8_t note;			// In the period table, for arpeggio
+	uint16_t porta_target;		// Tone portamento period
+	uint8_t porta_speed;
+	uint8_t glissando;		// Tone portamento by semitones
+	uint8_t vibrato;		// Speed (high nibble) and depth
+	uint8_t tremolo;
+	uint8_t waves;			// Vibrato (low nibble) and tremolo waveforms
+	uint8_t vibrato_pos;		// In the waveform, 0-63
+	uint8_t tremolo_pos;
+	uint8_t delay_inst;		// Note held back by EDx
+	uint16_t delay_period;
+	uint8_t delay_pos;		// ...from this song position and row
+	uint8_t delay_row;
 	int8_t* sample;
 	uint32_t pos;			// phase accumulator in fixed-point
 	uint32_t phaseinc;		// increment/pitch
@@ -30,6 +80,63 @@ typedef struct {
 	uint32_t repeat_end;		// Fixed-point
 } mpschan_t;
 
+/* Samples after and before each instrument in an arena (see lmp_load_arena()) */
+#define LMP_ARENA_GUARD		8
+#define LMP_ARENA_FRONT		4
+
+/* Packed instruments are blocks of LMP_PACK_BLOCK samples, each a starting
+ * value (int8), a shift, then per sample a signed 4-bit delta (low nibble
+ * first) from the one before, scaled by 1 << shift.
+ */
+#define LMP_PACK_BLOCK		64
+#define LMP_PACK_BLOCK_BYTES	(2 + LMP_PACK_BLOCK/2)
+#define LMP_PACK_SIZE(len)	(((len) + LMP_PACK_BLOCK - 1)/LMP_PACK_BLOCK*LMP_PACK_BLOCK_BYTES)
+
+/* A voice's decoded samples from a packed instrument, around its position */
+typedef struct {
+	const int8_t *src;		// The instrument's blocks, or NULL
+	uint32_t len;			// And its length (fixed-point), as empty ones share src
+	uint32_t base;			// Sample at data[LMP_ARENA_FRONT], block aligned
+	int8_t data[LMP_ARENA_FRONT + LMP_PACK_WINDOW];
+} lmp_window_t;
+
+/* Sizes of the per-rate tables, indexed from the lowest tempo/period: */
+#define LMP_SPT_TABLE_SIZE	(255 - 32 + 1)
+#define LMP_PI_TABLE_SIZE	(856 - 113 + 1)
+
+/* Samples per tick and phase increments at an output rate and rate shift,
+ * which any number of players can share; see lmp_rate_tables_init()
+ */
+typedef struct {
+	unsigned int samplerate;
+	uint8_t rate_shift;		// As limited for the rate
+	uint16_t spt_table[LMP_SPT_TABLE_SIZE];	// Samples per tick, by tempo
+	uint16_t pi_table[LMP_PI_TABLE_SIZE];	// Phase increment, by period
+} lmp_rate_tables_t;
+
+#ifdef LMP_STATS
+/* Counters kept when built with LMP_STATS (which must then be defined for
+ * everything including this header, as it changes mps_t).  Cycle counts are
+ * in units of LMP_CYCLES(), and everything wraps.
+ */
+typedef struct {
+	uint32_t rows;			// Pattern rows processed
+	uint32_t ticks;
+	uint32_t notes;			// Note triggers
+	uint32_t voice_samples;		// Voice-samples mixed
+	uint32_t loop_wraps;		// Voices wrapped to their loop start
+	uint32_t buffer_voice_samples;	// Voice-samples mixed in the last buffer
+	uint32_t tick_cycles;		// Last lmp_tick()
+	uint32_t tick_cycles_max;
+	uint32_t buffer_tick_cycles;	// All ticks in the last buffer
+	uint32_t mix_cycles;		// Last buffer, less its ticks
+	uint32_t mix_cycles_max;
+} lmp_stats_t;
+#endif
+
+/* A parsed module.  Players only read it, so one can be shared by any number
+ * of players (of the same or different sample rates).
+ */
 typedef struct {
 	uint8_t *mod_data;
 
@@ -37,18 +144,55 @@ typedef struct {
 	uint8_t *sequence;
 	uint8_t length;
 	uint32_t *patterns;
+	mpsnote_t *notes;		// Predecoded patterns, or NULL
+	uint8_t *notes_map;		// Pattern number to slot in notes[]
 
 	mpsamp_t inst[31];
 
+	uint8_t thirtyone;
+	uint8_t channels;
+	uint8_t flt8;			// Startrekker 8 channel, as pairs of 4 channel patterns
+	uint8_t guarded;		// Instruments are in a guard-padded arena
+	uint8_t packed;			// Instruments are packed (LMP_PACK_BLOCK blocks)
+} lmp_module_t;
+
+/* Something the sequencer did, at a frame of a buffer; see lmp_set_events() */
+typedef struct {
+	uint32_t frame;			// In the buffer; its length means the next's start
+	uint8_t type;			// LMP_EVENT_xxx
+	uint8_t pos;			// Song position and row
+	uint8_t row;
+	uint8_t chan;			// For notes and syncs
+	uint8_t value;			// Note: instrument (0-based); sync: parameter
+	uint8_t command;		// Sync: 0x8 (8xx) or 0xe (E8x)
+} lmp_event_t;
+
+#define LMP_EVENT_ROW		0	/* A row is played */
+#define LMP_EVENT_PATTERN	1	/* ...the first of a new song position */
+#define LMP_EVENT_NOTE		2	/* A note is triggered on a channel */
+#define LMP_EVENT_LOOP		3	/* The song went back to the start */
+#define LMP_EVENT_SYNC		4	/* 8xx or E8x, which LMP otherwise ignores */
+
+struct lmp_stream;
+struct lmp_cache;
+
+/* Per-player state */
+typedef struct {
+	const lmp_module_t *mod;
+	struct lmp_stream *stream;	// Ticks come from this, if streaming
+	struct lmp_cache *cache;	// Loop PCM cache, or NULL
+
 	// State
 	unsigned int pos;		// 0 to length-1
 	unsigned int pos_pattern; 	// 0 to 63
 	unsigned int speed;
 	unsigned int tick_counter;
 	unsigned int tempo;
+	uint8_t loop_row;		// E6x pattern loop
+	uint8_t loop_count;
+	uint8_t pattern_delay;		// EEx rows left
 
-	// Format/config
-	uint8_t thirtyone;
+	// Config
 	uint8_t song_loop;
 	/* A couple of modules do not use Fxx commands quite the same as others,
 	 * for example F20 and F30 (which set a very low tempo, unexpected for
@@ -56,14 +200,103 @@ typedef struct {
 	 */
 	uint8_t support_tempo;
 	uint8_t stereo;			// 0: mono mix, 1 stereo
+	uint8_t interp;			// LMP_INTERP_xxx
+	uint8_t rate_shift;		// Voices are mixed at samplerate >> this
+	uint32_t mute;			// Channels moved on without mixing
+	unsigned int samplerate;
+
+	// Tables for the current rate: the caller's, and those in use (those,
+	// the built-in ones for LMP_SAMPLERATE, or NULL to divide)
+	const lmp_rate_tables_t *rate_tables;
+	const lmp_rate_tables_t *tables;
+	uint32_t pi_num;		// Phase increment for period 1
 
 	// Channel state
-	mpschan_t cs[4];
+	mpschan_t cs[LMP_MAX_CHANNELS];
+	uint32_t active;		// Mask of channels that are on
+	uint8_t silent;			// Last buffer had no voices playing
+#if LMP_PACK_WINDOW
+	lmp_window_t window[LMP_MAX_CHANNELS];	// For a packed module
+#endif
+
+	// At a reduced mixing rate, output frames into the current mixed
+	// one, and the last two mixed frames (per side) interpolated between
+	uint8_t sub_frame;
+	int32_t up[2][2];
 
 	unsigned int sample_counter;
 	unsigned int samples_per_tick;
+
+	// Events, if reporting them
+	lmp_event_t *events;
+	unsigned int max_events;
+	unsigned int num_events;	// In the last buffer, including dropped
+	uint32_t event_frame;		// Frames into the buffer
+	uint8_t new_pos;		// The next row starts a song position
+
+#ifdef LMP_STATS
+	lmp_stats_t stats;
+#endif
 } mps_t;
 
+typedef mps_t lmp_player_t;
+
+/* A player's sequencer/channel state, at a frame of the song */
+typedef struct {
+	uint32_t frame;
+	uint8_t pos;
+	uint8_t pos_pattern;
+	uint8_t speed;
+	uint8_t tick_counter;
+	uint8_t tempo;
+	uint8_t loop_row;
+	uint8_t loop_count;
+	uint8_t pattern_delay;
+	uint8_t sub_frame;
+	uint16_t sample_counter;
+	uint16_t samples_per_tick;
+	uint32_t active;
+	int32_t up[2][2];
+	mpschan_t cs[];			// One per channel of the module
+} lmp_snapshot_t;
+
+/* A rendered loop of the song; see lmp_cache_init() */
+typedef struct lmp_cache {
+	uint8_t state;
+	uint8_t pos;			// The row the song loops back to
+	uint8_t row;
+	uint8_t mix_type;		// Of the recording
+	int16_t *pcm;
+	uint32_t capacity;		// In samples
+	uint32_t length;		// Recorded so far/in the loop
+	uint32_t read;			// Playing from here
+	lmp_snapshot_t *snap;		// The player, at the start of the recording
+} lmp_cache_t;
+
+/* Seek index; followed in memory by count snapshots of stride bytes */
+typedef struct {
+	unsigned int samplerate;	// It was built at
+	unsigned int channels;
+	unsigned int stride;
+	unsigned int count;
+	uint32_t end;			// Frame the song ended at, or the index filled up
+} lmp_index_t;
+
+/* Snapshots hold pointers, so start after the index header rounded up for them: */
+#define LMP_SNAPSHOT_ALIGN	_Alignof(lmp_snapshot_t)
+#define LMP_INDEX_HEADER_SIZE	((sizeof(lmp_index_t) + LMP_SNAPSHOT_ALIGN - 1) & \
+				 ~(LMP_SNAPSHOT_ALIGN - 1))
+#define LMP_INDEX_SNAPSHOT(idx, i)	((lmp_snapshot_t *)((uint8_t *)(idx) + \
+					 LMP_INDEX_HEADER_SIZE + (i)*(idx)->stride))
+
+/* One tick of a stream's sequencer, queued for its mixer */
+typedef struct {
+	unsigned int frames;		// Until the next tick
+	uint32_t trigger;		// Channels starting a note
+	uint8_t done;
+	mpschan_t cs[LMP_MAX_CHANNELS];
+} lmp_tick_t;
+
 int	lmp_fill_buffer_mono(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size);
 int	lmp_fill_buffer_stereo_hard(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size);
 int	lmp_fill_buffer_stereo_soft(mps_t *mps, int16_t *samples, unsigned int sample_buffer_size);
@@ -73,16 +306,228 @@ int	lmp_fill_buffer_stereo_soft(mps_t *mps, int16_t *samples, unsigned int sampl
 
 typedef enum { LMP_MONO, LMP_STEREO_SOFT, LMP_STEREO_HARD } lmp_mix_t;
 
-int 		lmp_init(mps_t *mps, uint8_t *mod_base);
+/* For LMP_BUILD_MIXERS, to build only some mixers into the project: each
+ * mix type is built for each output type it's or'd with, e.g.
+ * (LMP_BUILD_STEREO_SOFT | LMP_BUILD_S16).
+ */
+#define LMP_BUILD_MONO		(1U << LMP_MONO)
+#define LMP_BUILD_STEREO_SOFT	(1U << LMP_STEREO_SOFT)
+#define LMP_BUILD_STEREO_HARD	(1U << LMP_STEREO_HARD)
+#define LMP_BUILD_S16		(1U << 3)	/* lmp_fill_buffer() */
+#define LMP_BUILD_S32		(1U << 4)	/* lmp_mix_buffer_s32() */
+#define LMP_BUILD_F32		(1U << 5)	/* lmp_mix_buffer_f32() */
+#define LMP_BUILD_S32_LJ	(1U << 6)	/* lmp_fill_buffer_fmt() formats */
+#define LMP_BUILD_S24		(1U << 7)
+#define LMP_BUILD_SWAP		(1U << 8)	/* ...and their swapped stereo */
+#define LMP_BUILD_ALL		0x1ff
+
+/* For LMP_BUILD_FEATURES, to leave out the parts of the player a project
+ * doesn't use, from the hot path and all.  Their functions aren't built.
+ */
+#define LMP_FEATURE_CACHE	(1U << 0)	/* lmp_cache_init() */
+#define LMP_FEATURE_STREAM	(1U << 1)	/* lmp_stream_init() and friends */
+#define LMP_FEATURE_EVENTS	(1U << 2)	/* lmp_set_events() */
+#define LMP_FEATURE_RATE_SHIFT	(1U << 3)	/* LMP_OPT_RATE_SHIFT (ignored if not) */
+#define LMP_FEATURE_SEEK	(1U << 4)	/* lmp_index_build(), lmp_seek(), lmp_skip_samples() */
+#define LMP_FEATURE_STEMS	(1U << 5)	/* lmp_fill_stems() */
+#define LMP_FEATURE_TABLES	(1U << 6)	/* Built-in tables for LMP_SAMPLERATE */
+#define LMP_FEATURE_ALL		0x7f
+
+/* Parse a module once, then start any number of players on it: */
+int		lmp_module_init(lmp_module_t *mod, uint8_t *mod_base);
+int		lmp_player_init(mps_t *mps, const lmp_module_t *mod);
+
+/* Or both at once, for one player: */
+int 		lmp_init(mps_t *mps, lmp_module_t *mod, uint8_t *mod_base);
 
 unsigned int 	lmp_get_length(mps_t *mps);
 
+int		lmp_last_buffer_silent(mps_t *mps);
+
 void		lmp_set_pos(mps_t *mps, unsigned int pos);
 
+/* Song length and loop point in frames (output samples, or stereo pairs),
+ * found without rendering:
+ */
+uint32_t	lmp_get_duration(const mps_t *mps, uint32_t *loop_frame);
+
+/* Optionally, have each lmp_fill_buffer() (or mix) call list the events in
+ * the buffer it rendered, in order, into an array of up to max_events (NULL
+ * to stop).  lmp_get_events() returns how many there were in the last
+ * buffer, and the number that didn't fit.  The players that lmp_seek() and
+ * friends run internally, and streams, don't report events.
+ */
+void		lmp_set_events(mps_t *mps, lmp_event_t *events, unsigned int max_events);
+unsigned int	lmp_get_events(mps_t *mps, unsigned int *dropped);
+
+/* Copy a player, e.g. to render from the same point independently.  The copy
+ * doesn't report events, or use a cache or stream.
+ */
+void		lmp_player_copy(mps_t *dst, const mps_t *src);
+
+/* Optionally, for a looping song, record one loop of the s16 output into a
+ * buffer from the caller (of any alignment), the first time
+ * round that it's the same as the next.  lmp_fill_buffer() then copies from
+ * it, until anything changes the player (or its mix type, or events are
+ * wanted) when it goes back to rendering, from where it was.  If the loop
+ * doesn't fit, nothing's cached.  Returns 0, or -1 if the buffer is too
+ * small for even the player's snapshot.
+ */
+unsigned int	lmp_cache_size(const mps_t *mps, lmp_mix_t mix_type);
+int		lmp_cache_init(mps_t *mps, lmp_cache_t *cache, void *buffer, unsigned int size);
+void		lmp_cache_stop(mps_t *mps);
+
+/* Optionally, build an index of snapshots through the song, from which a
+ * player can seek to any frame (an output sample, or stereo pair), in a
+ * buffer aligned as for a pointer (as from malloc()).  The output from there
+ * is exactly as if every frame before it had been rendered.
+ */
+unsigned int	lmp_index_size(const mps_t *mps, unsigned int snapshots);
+int		lmp_index_build(const mps_t *mps, unsigned int every_rows,
+				void *buffer, unsigned int size);
+int		lmp_seek(mps_t *mps, const lmp_index_t *idx, uint32_t frame);
+
+/* Fast-forward by a number of frames without mixing them, e.g. to resync a
+ * late stream, leaving the player exactly as if they'd been rendered.
+ * Returns as for lmp_fill_buffer().
+ */
+int		lmp_skip_samples(mps_t *mps, uint32_t frames);
+
+/* Optionally, unpack the song's patterns into (word-aligned) memory provided
+ * by the caller, which is faster to play from:
+ */
+unsigned int	lmp_predecode_size(const lmp_module_t *mod);
+int		lmp_predecode(lmp_module_t *mod, void *buffer, unsigned int size);
+
+/* Optionally, copy the instruments into memory provided by the caller, with
+ * guard samples so that mixing is cheaper.  (Do this before starting players,
+ * or they'll finish their current notes from the old samples.)  A packed
+ * module's instruments are unpacked into it.
+ */
+unsigned int	lmp_arena_size(const lmp_module_t *mod);
+int		lmp_load_arena(lmp_module_t *mod, void *arena, unsigned int size);
+
 #define LMP_OPT_LOOP		0	/* Default: yes */
 #define LMP_OPT_SUPPORT_TEMPO	1	/* Default: yes */
+#define LMP_OPT_SAMPLERATE	2	/* Default: LMP_SAMPLERATE (44100); 4000-192000 */
+#define LMP_OPT_INTERP		3	/* Default: LMP_INTERP_LINEAR */
+#define LMP_OPT_RATE_SHIFT	4	/* Default: 0; 1 or 2 to mix at 1/2 or 1/4 rate (low power) */
+#define LMP_OPT_MUTE		5	/* Default: 0; mask of channels (bit n: channel n) to leave out */
+
+/* Interpolation between instrument samples, cheapest first.  Sinc is an
+ * 8-tap Lanczos window; it and cubic need an arena for clean sample ends.
+ */
+#define LMP_INTERP_NONE		0
+#define LMP_INTERP_LINEAR	1
+#define LMP_INTERP_CUBIC	2
+#define LMP_INTERP_SINC		3
 void		lmp_set_option(mps_t *mps, unsigned int option, unsigned int val);
 
+/* Optionally, build the tables that players look pitches and tick lengths up
+ * in, for a sample rate and LMP_OPT_RATE_SHIFT, for any number of players to
+ * share.  A player uses them (until given NULL) whenever its rate and shift
+ * match.  Those for LMP_SAMPLERATE are built in (with LMP_FEATURE_TABLES);
+ * otherwise, players without tables divide instead, at each change of pitch
+ * or tempo.  The output is the same either way.
+ */
+void		lmp_rate_tables_init(lmp_rate_tables_t *t, unsigned int samplerate,
+				     unsigned int rate_shift);
+void		lmp_set_rate_tables(mps_t *mps, const lmp_rate_tables_t *t);
+
+/* Render and add into a caller's buffer, without truncating to s16.  For the
+ * s32 variant, gain is 16.16 fixed point (LMP_GAIN_UNITY adds exactly the
+ * lmp_fill_buffer() samples); for float, 1.0 maps s16 full scale to +/-1.0.
+ */
+#define LMP_GAIN_UNITY		0x10000
+int	lmp_mix_buffer_s32(mps_t *mps, int32_t *acc, unsigned int sample_buffer_size,
+			   lmp_mix_t mix_type, int32_t gain);
+int	lmp_mix_buffer_f32(mps_t *mps, float *acc, unsigned int sample_buffer_size,
+			   lmp_mix_t mix_type, float gain);
+
+/* Render straight into the slot format of an I2S/SAI peripheral's DMA
+ * buffer.  sample_buffer_size is in samples (slots), as for lmp_fill_buffer().
+ * Each format/swap is its own mixer (see LMP_BUILD_MIXERS); returns -1 for one
+ * that isn't built.  Only plain s16 goes through the loop cache.
+ */
+#define LMP_FMT_S16		0	/* As lmp_fill_buffer() */
+/* The 24-bit formats carry 8 more bits than s16.  Their top 16 bits are
+ * rounded down, not towards zero, so can be 1 below s16's for negative samples.
+ */
+#define LMP_FMT_S32_LJ		1	/* 32-bit slots, left-justified: 24 bits of level */
+#define LMP_FMT_S24_PACKED	2	/* 3 bytes per sample, little-endian */
+#define LMP_FMT_SWAP		0x10	/* Or'd in: right then left, for stereo */
+#define LMP_FMT_BYTES(fmt)	((((fmt) & 0xf) == LMP_FMT_S16) ? 2 : \
+				 (((fmt) & 0xf) == LMP_FMT_S24_PACKED) ? 3 : 4)
+int	lmp_fill_buffer_fmt(mps_t *mps, void *out, unsigned int sample_buffer_size,
+			    lmp_mix_t mix_type, unsigned int fmt);
+
+/* Render one plane per channel, each s16 at the level of a single voice (so
+ * that their average is the mono mix), for frames frames.  Channels whose
+ * plane is NULL, or that are muted, aren't mixed.  Returns as for
+ * lmp_fill_buffer(), or -1 at a reduced mixing rate.
+ */
+int	lmp_fill_stems(mps_t *mps, int16_t *const *planes, unsigned int frames);
+
+/* Double-buffered output, for a DMA controller that interrupts as it drains
+ * each half of a circular buffer.  The sequencer runs from a copy of the
+ * player, a few ticks ahead of the mixer, so it can be moved out of the
+ * interrupt (see lmp_stream_set_low_water()).
+ */
+typedef struct lmp_stream {
+	mps_t *mps;			// Mixes, from the interrupt
+	mps_t seq;			// Sequences, ahead
+	void *buffer;
+	unsigned int buffer_size;	// In samples, both halves
+	lmp_mix_t mix_type;
+	unsigned int format;		// LMP_FMT_xxx
+
+	void (*low_water)(void *arg);
+	void *low_water_arg;
+	unsigned int low_water_ticks;
+	uint32_t underruns;		// Ticks the mixer had to wait for
+
+	unsigned int head;		// Written by the sequencer
+	unsigned int tail;		// Written by the mixer
+	lmp_tick_t ticks[LMP_STREAM_TICKS];
+} lmp_stream_t;
+
+/* Start streaming a player into buffer, which is first filled (both halves),
+ * so DMA can be started straight after.  The player's options must be set
+ * beforehand.  While streaming, the song position is that of stream->seq,
+ * up to LMP_STREAM_TICKS ahead of what's heard.
+ */
+void		lmp_stream_init(lmp_stream_t *s, mps_t *mps, int16_t *buffer,
+				unsigned int buffer_size, lmp_mix_t mix_type);
+/* Or for a buffer of another LMP_FMT_xxx format: */
+void		lmp_stream_init_fmt(lmp_stream_t *s, mps_t *mps, void *buffer,
+				    unsigned int buffer_size, lmp_mix_t mix_type,
+				    unsigned int format);
+
+/* Call from the half/full transfer interrupts, to render the half that has
+ * just been sent.  Return 0 when the song is done.
+ */
+int		lmp_on_half_transfer(lmp_stream_t *s);
+int		lmp_on_full_transfer(lmp_stream_t *s);
+
+/* By default, the interrupts sequence ticks as they need them.  With a hook
+ * (set before starting DMA, which fills the queue), they only mix: the hook
+ * is called when ticks or fewer are queued, and should arrange for
+ * lmp_stream_sequence() to be called at a lower priority.
+ * If the queue runs dry, the mixer holds the current notes until it catches
+ * up (counted in underruns).  The queue needs to hold comfortably more ticks
+ * than are in half the buffer.
+ */
+void		lmp_stream_set_low_water(lmp_stream_t *s, unsigned int ticks,
+					 void (*hook)(void *arg), void *arg);
+
+/* Fill the tick queue; returns the number of ticks queued */
+unsigned int	lmp_stream_sequence(lmp_stream_t *s);
+
+#ifdef LMP_STATS
+const lmp_stats_t	*lmp_get_stats(mps_t *mps);
+void			lmp_reset_stats(mps_t *mps);
+#endif
+
 /* The main generation routine is selected by stereo/mono mix type (hopefully statically): */
 static inline int	lmp_fill_buffer(mps_t *mps, int16_t *samples,
 					unsigned int sample_buffer_size,
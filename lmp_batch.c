@@ -0,0 +1,585 @@
+/*
+ * Little Module Player batch renderer
+ *
+ * Renders a list of in-memory modules on a pool of threads.  Each worker
+ * starts with an even share of the jobs, takes them from the front of its
+ * share, and when that runs out steals from the back of someone else's; so
+ * long and short songs balance out without a shared queue to contend on.
+ *
+ * Workers keep their output, arena and predecode buffers between jobs, so
+ * (once they've grown) rendering doesn't allocate.  The instruments are
+ * copied into an arena, so modules need no padding at the end.
+ *
+ * lmp_batch_render_song() splits one song between threads instead: segments
+ * start at rows from a seek index, and are rendered concurrently straight
+ * into the caller's buffer.  The output is the same as a serial render.
+ *
+ * Built with LMP_BATCH_MAIN, this is also a tool to render files:
+ *
+ * >  lmp_batch [-j threads] [-r rate] [-m mono|hard|soft] [-t seconds] [-o dir] [-p] <files...>
+ *
+ * Each <name>.mod is written to <dir>/<name>.raw (s16 LE, interleaved if
+ * stereo).  -p renders the files one at a time, each split between the
+ * threads.
+ *
+ * (c) 2021 Matt Evans
+ */
+
+#ifdef LMP_BATCH_MAIN
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lmp_batch.h"
+
+#define DEFAULT_BUFFERSIZE	4096	/* In samples */
+#define CACHELINE		64
+
+/* Song segments per thread, so that they balance out: */
+#define SEGMENTS_PER_THREAD	4
+/* Rows between the snapshots segments can start at: */
+#define SEGMENT_ROWS		4
+
+typedef struct {
+	/* Jobs [first, end) not yet taken: first in the low half, end in the
+	 * high, so that the owner and a thief can't both take the last one.
+	 */
+	_Alignas(CACHELINE) _Atomic uint64_t range;
+} lmp_batch_queue_t;
+
+typedef struct {
+	pthread_t thread;
+	unsigned int id;
+	struct lmp_batch *batch;
+
+	int16_t *out;
+	size_t out_size;		// In samples
+	void *arena;
+	size_t arena_size;		// In bytes
+	void *notes;
+	size_t notes_size;
+} lmp_batch_worker_t;
+
+struct lmp_batch {
+	const lmp_batch_job_t *jobs;
+	const lmp_batch_opts_t *opts;
+	unsigned int buffer_size;
+	lmp_batch_done_t done;
+	void *arg;
+
+	unsigned int num_workers;
+	lmp_batch_queue_t *queues;
+	lmp_batch_worker_t *workers;
+	_Atomic unsigned int failed;
+};
+
+#define RANGE(first, end)	(((uint64_t)(end) << 32) | (first))
+#define RANGE_FIRST(r)		((uint32_t)(r))
+#define RANGE_END(r)		((uint32_t)((r) >> 32))
+
+/* Take a job from the front of a queue (owner) or the back (thief).
+ * Returns 0 if it's empty.
+ */
+static int	lmp_batch_take(lmp_batch_queue_t *q, int from_back, unsigned int *job)
+{
+	uint64_t r = atomic_load(&q->range);
+
+	for (;;) {
+		uint32_t first = RANGE_FIRST(r), end = RANGE_END(r);
+		uint64_t nr;
+
+		if (first >= end)
+			return 0;
+		if (from_back) {
+			nr = RANGE(first, end - 1);
+			*job = end - 1;
+		} else {
+			nr = RANGE(first + 1, end);
+			*job = first;
+		}
+		if (atomic_compare_exchange_weak(&q->range, &r, nr))
+			return 1;
+	}
+}
+
+static int	lmp_batch_next(lmp_batch_worker_t *w, unsigned int *job)
+{
+	struct lmp_batch *b = w->batch;
+
+	if (lmp_batch_take(&b->queues[w->id], 0, job))
+		return 1;
+	for (unsigned int i = 1; i < b->num_workers; i++) {
+		if (lmp_batch_take(&b->queues[(w->id + i) % b->num_workers], 1, job))
+			return 1;
+	}
+	return 0;
+}
+
+/* Grow one of the worker's buffers; returns 0, or -1 if out of memory. */
+static int	lmp_batch_grow(void **buf, size_t *size, size_t want, size_t unit)
+{
+	void *n;
+
+	if (want <= *size)
+		return 0;
+	n = realloc(*buf, want*unit);
+	if (!n)
+		return -1;
+	*buf = n;
+	*size = want;
+	return 0;
+}
+
+static int	lmp_batch_render_one(lmp_batch_worker_t *w, const lmp_batch_job_t *job,
+				     size_t *num_samples)
+{
+	const lmp_batch_opts_t *opts = w->batch->opts;
+	unsigned int bs = w->batch->buffer_size;
+	lmp_module_t mod;
+	mps_t mps;
+	size_t count = 0;
+	int more;
+
+	if (lmp_module_init(&mod, job->mod_data))
+		return -1;
+
+	if (lmp_batch_grow(&w->arena, &w->arena_size, lmp_arena_size(&mod), 1) ||
+	    lmp_load_arena(&mod, w->arena, w->arena_size))
+		return -1;
+	if (lmp_batch_grow(&w->notes, &w->notes_size, lmp_predecode_size(&mod), 1) ||
+	    lmp_predecode(&mod, w->notes, w->notes_size))
+		return -1;
+	if (lmp_player_init(&mps, &mod))
+		return -1;
+
+	lmp_set_option(&mps, LMP_OPT_LOOP, 0);
+	if (opts->samplerate)
+		lmp_set_option(&mps, LMP_OPT_SAMPLERATE, opts->samplerate);
+
+	do {
+		if (lmp_batch_grow((void **)&w->out, &w->out_size, count + bs,
+				   sizeof(int16_t)))
+			return -1;
+		more = lmp_fill_buffer(&mps, w->out + count, bs, opts->mix_type);
+		count += bs;
+	} while (more && (!opts->max_samples || count < opts->max_samples));
+
+	if (opts->max_samples && count > opts->max_samples)
+		count = opts->max_samples;
+	*num_samples = count;
+	return 0;
+}
+
+static void	*lmp_batch_worker(void *p)
+{
+	lmp_batch_worker_t *w = p;
+	struct lmp_batch *b = w->batch;
+	unsigned int j;
+
+	while (lmp_batch_next(w, &j)) {
+		size_t n = 0;
+		int status = lmp_batch_render_one(w, &b->jobs[j], &n);
+
+		if (status)
+			atomic_fetch_add(&b->failed, 1);
+		b->done(&b->jobs[j], status, status ? NULL : w->out, n, b->arg);
+	}
+	return NULL;
+}
+
+int	lmp_batch_render(const lmp_batch_job_t *jobs, unsigned int num_jobs,
+			 const lmp_batch_opts_t *opts, lmp_batch_done_t done,
+			 void *arg)
+{
+	struct lmp_batch b;
+	unsigned int started = 0;
+	int r = 0;
+
+	b.jobs = jobs;
+	b.opts = opts;
+	b.buffer_size = opts->buffer_size ? opts->buffer_size : DEFAULT_BUFFERSIZE;
+	b.done = done;
+	b.arg = arg;
+	atomic_init(&b.failed, 0);
+
+	b.num_workers = opts->threads;
+	if (!b.num_workers) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		b.num_workers = n > 0 ? n : 1;
+	}
+	if (b.num_workers > num_jobs)
+		b.num_workers = num_jobs ? num_jobs : 1;
+	/* A stereo mix needs whole frames: */
+	if (opts->mix_type != LMP_MONO)
+		b.buffer_size &= ~1U;
+
+	b.queues = aligned_alloc(CACHELINE, b.num_workers*sizeof(lmp_batch_queue_t));
+	b.workers = calloc(b.num_workers, sizeof(lmp_batch_worker_t));
+	if (!b.queues || !b.workers) {
+		free(b.queues);
+		free(b.workers);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < b.num_workers; i++) {
+		atomic_init(&b.queues[i].range,
+			    RANGE((uint64_t)num_jobs*i/b.num_workers,
+				  (uint64_t)num_jobs*(i + 1)/b.num_workers));
+		b.workers[i].id = i;
+		b.workers[i].batch = &b;
+	}
+
+	for (; started < b.num_workers; started++) {
+		if (pthread_create(&b.workers[started].thread, NULL,
+				   lmp_batch_worker, &b.workers[started]))
+			break;
+	}
+	/* If some threads didn't start, the others steal their jobs. */
+	if (!started)
+		r = -1;
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(b.workers[i].thread, NULL);
+	}
+	for (unsigned int i = 0; i < b.num_workers; i++) {
+		free(b.workers[i].out);
+		free(b.workers[i].arena);
+		free(b.workers[i].notes);
+	}
+	free(b.queues);
+	free(b.workers);
+
+	return r ? r : (int)atomic_load(&b.failed);
+}
+
+
+struct lmp_segments {
+	const mps_t *mps;
+	const lmp_index_t *idx;
+	lmp_mix_t mix_type;
+	unsigned int samples_per_frame;
+	int16_t *out;
+
+	unsigned int num_segments;
+	uint32_t *starts;		// num_segments + 1, the last being the end
+	_Atomic unsigned int next;
+};
+
+static void	*lmp_segment_worker(void *p)
+{
+	struct lmp_segments *s = p;
+	unsigned int i;
+
+	while ((i = atomic_fetch_add(&s->next, 1)) < s->num_segments) {
+		uint32_t frame = s->starts[i], end = s->starts[i + 1];
+		uint32_t chunk = DEFAULT_BUFFERSIZE/s->samples_per_frame;
+		mps_t mps;
+
+		lmp_player_copy(&mps, s->mps);
+		lmp_seek(&mps, s->idx, frame);
+		while (frame < end) {
+			uint32_t n = (end - frame < chunk) ? end - frame : chunk;
+
+			lmp_fill_buffer(&mps, s->out + (size_t)frame*s->samples_per_frame,
+					n*s->samples_per_frame, s->mix_type);
+			frame += n;
+		}
+	}
+	return NULL;
+}
+
+/* Frame of the last snapshot at or before frame */
+static uint32_t	lmp_segment_snap(const lmp_index_t *idx, uint32_t frame)
+{
+	unsigned int lo = 0, hi = idx->count;
+
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi)/2;
+
+		if (LMP_INDEX_SNAPSHOT(idx, mid)->frame <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return LMP_INDEX_SNAPSHOT(idx, lo)->frame;
+}
+
+int	lmp_batch_render_song(const mps_t *mps, lmp_mix_t mix_type, int16_t *out,
+			      uint32_t frames, unsigned int threads)
+{
+	/* Rows in a pass through the song are limited by the sequence: */
+	unsigned int max_snaps = 256*64/SEGMENT_ROWS + 1;
+	unsigned int size = lmp_index_size(mps, max_snaps);
+	struct lmp_segments s;
+	pthread_t *tids;
+	unsigned int started = 0;
+	void *idx;
+
+	if (!threads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? n : 1;
+	}
+
+	idx = malloc(size);
+	s.num_segments = threads*SEGMENTS_PER_THREAD;
+	s.starts = malloc((s.num_segments + 1)*sizeof(uint32_t));
+	tids = malloc(threads*sizeof(pthread_t));
+	if (!idx || !s.starts || !tids) {
+		free(idx);
+		free(s.starts);
+		free(tids);
+		return -1;
+	}
+	lmp_index_build(mps, SEGMENT_ROWS, idx, size);
+
+	s.mps = mps;
+	s.idx = idx;
+	s.mix_type = mix_type;
+	s.samples_per_frame = (mix_type == LMP_MONO) ? 1 : 2;
+	s.out = out;
+	atomic_init(&s.next, 0);
+
+	/* Split evenly, moving each split back to a row where the index has
+	 * one (beyond the end of the index, anywhere will do):
+	 */
+	s.starts[0] = 0;
+	for (unsigned int i = 1; i < s.num_segments; i++) {
+		uint32_t split = (uint64_t)frames*i/s.num_segments;
+		uint32_t row = lmp_segment_snap(idx, split);
+
+		if (split <= ((lmp_index_t *)idx)->end && row > s.starts[i - 1])
+			split = row;
+		s.starts[i] = split;
+	}
+	s.starts[s.num_segments] = frames;
+
+	/* This thread works too: */
+	for (; started < threads - 1; started++) {
+		if (pthread_create(&tids[started], NULL, lmp_segment_worker, &s))
+			break;
+	}
+	lmp_segment_worker(&s);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	free(idx);
+	free(s.starts);
+	free(tids);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef LMP_BATCH_MAIN
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <libgen.h>
+
+static const char *out_dir = ".";
+
+/* Load a module fully into memory, returns NULL on failure */
+static uint8_t	*load_file(const char *path)
+{
+	struct stat sb;
+	uint8_t *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < 0x43c) {
+		fprintf(stderr, "%s: not a module\n", path);
+		close(fd);
+		return NULL;
+	}
+	data = malloc(sb.st_size);
+	if (!data) {
+		fprintf(stderr, "Can't alloc %ld!\n", (long)sb.st_size);
+		close(fd);
+		return NULL;
+	}
+	for (off_t got = 0; got < sb.st_size; ) {
+		ssize_t r = read(fd, data + got, sb.st_size - got);
+		if (r <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		got += r;
+	}
+	close(fd);
+	return data;
+}
+
+static void	write_render(const lmp_batch_job_t *job, int status,
+			     const int16_t *samples, size_t num_samples, void *arg)
+{
+	const char *path = job->user;
+	char *name, *dot, *out;
+	FILE *f;
+
+	if (status) {
+		fprintf(stderr, "%s: can't play\n", path);
+		return;
+	}
+
+	name = strdup(path);
+	dot = strrchr(basename(name), '.');
+	if (dot)
+		*dot = '\0';
+	if (asprintf(&out, "%s/%s.raw", out_dir, basename(name)) < 0) {
+		free(name);
+		return;
+	}
+	f = fopen(out, "wb");
+	if (!f || fwrite(samples, sizeof(int16_t), num_samples, f) != num_samples)
+		perror(out);
+	else
+		printf("%s: %zu samples\n", out, num_samples);
+	if (f)
+		fclose(f);
+	free(out);
+	free(name);
+}
+
+/* Render one job split between the threads, to the same length as
+ * lmp_batch_render() would: whole buffers, up to the one the song ends in.
+ */
+static int	render_song(const lmp_batch_job_t *job, const lmp_batch_opts_t *opts)
+{
+	unsigned int spf = (opts->mix_type == LMP_MONO) ? 1 : 2;
+	unsigned int bs = (opts->buffer_size ? opts->buffer_size : DEFAULT_BUFFERSIZE)/spf;
+	lmp_module_t mod;
+	mps_t mps, p;
+	uint32_t frames = 0;
+	void *arena;
+	int16_t *out = NULL;
+	int more, r = -1;
+
+	if (lmp_module_init(&mod, job->mod_data)) {
+		write_render(job, -1, NULL, 0, NULL);
+		return -1;
+	}
+	arena = malloc(lmp_arena_size(&mod));
+	if (arena && !lmp_load_arena(&mod, arena, lmp_arena_size(&mod)) &&
+	    !lmp_player_init(&mps, &mod)) {
+		lmp_set_option(&mps, LMP_OPT_LOOP, 0);
+		if (opts->samplerate)
+			lmp_set_option(&mps, LMP_OPT_SAMPLERATE, opts->samplerate);
+
+		lmp_player_copy(&p, &mps);
+		do {
+			more = lmp_skip_samples(&p, bs);
+			frames += bs;
+		} while (more && (!opts->max_samples || (size_t)frames*spf < opts->max_samples));
+		if (opts->max_samples && (size_t)frames*spf > opts->max_samples)
+			frames = opts->max_samples/spf;
+
+		out = malloc((size_t)frames*spf*sizeof(int16_t));
+		if (out)
+			r = lmp_batch_render_song(&mps, opts->mix_type, out, frames,
+						  opts->threads);
+	}
+	write_render(job, r, out, (size_t)frames*spf, NULL);
+	free(out);
+	free(arena);
+	return r;
+}
+
+static void	usage(const char *me)
+{
+	fprintf(stderr, "Syntax: %s [-j threads] [-r rate] [-m mono|hard|soft] "
+		"[-t seconds] [-o dir] [-p] <files...>\n", me);
+	exit(1);
+}
+
+int 	main(int argc, char *argv[])
+{
+	lmp_batch_opts_t opts = { .mix_type = LMP_STEREO_SOFT };
+	lmp_batch_job_t *jobs;
+	unsigned int num_jobs = 0;
+	unsigned int rate = 44100;
+	unsigned int seconds = 60*5;
+	int split = 0;
+	int opt, r = 0;
+
+	while ((opt = getopt(argc, argv, "j:r:m:t:o:p")) != -1) {
+		switch (opt) {
+			case 'j':
+				opts.threads = atoi(optarg);
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'm':
+				if (!strcmp(optarg, "mono"))
+					opts.mix_type = LMP_MONO;
+				else if (!strcmp(optarg, "hard"))
+					opts.mix_type = LMP_STEREO_HARD;
+				else if (!strcmp(optarg, "soft"))
+					opts.mix_type = LMP_STEREO_SOFT;
+				else
+					usage(argv[0]);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'o':
+				out_dir = optarg;
+				break;
+			case 'p':
+				split = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	/* If loop detection didn't work, cap each song: */
+	opts.samplerate = rate;
+	opts.max_samples = (size_t)seconds*rate*(opts.mix_type == LMP_MONO ? 1 : 2);
+
+	jobs = calloc(argc - optind, sizeof(lmp_batch_job_t));
+	if (!jobs)
+		return 1;
+	for (int i = optind; i < argc; i++) {
+		uint8_t *data = load_file(argv[i]);
+
+		if (!data)
+			continue;
+		jobs[num_jobs].mod_data = data;
+		jobs[num_jobs].user = argv[i];
+		num_jobs++;
+	}
+
+	if (split) {
+		for (unsigned int i = 0; i < num_jobs; i++) {
+			if (render_song(&jobs[i], &opts))
+				r++;
+		}
+	} else {
+		r = lmp_batch_render(jobs, num_jobs, &opts, write_render, NULL);
+	}
+	if (r < 0) {
+		fprintf(stderr, "Can't start threads\n");
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < num_jobs; i++)
+		free(jobs[i].mod_data);
+	free(jobs);
+	return r ? 1 : 0;
+}
+
+#endif
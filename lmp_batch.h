@@ -0,0 +1,50 @@
+#ifndef LMP_BATCH_H
+#define LMP_BATCH_H
+
+#include <stddef.h>
+
+#include "littlemodplayer.h"
+
+/* Batch rendering of many modules, on a pool of threads (see lmp_batch.c) */
+
+typedef struct {
+	uint8_t *mod_data;		// In-memory module
+	void *user;			// For the caller, passed back with the render
+} lmp_batch_job_t;
+
+typedef struct {
+	unsigned int threads;		// 0: one per online CPU
+	lmp_mix_t mix_type;
+	unsigned int samplerate;	// 0: LMP_SAMPLERATE
+	unsigned int buffer_size;	// Samples per lmp_fill_buffer(); 0: 4096
+	size_t max_samples;		// Cap each render (songs can loop forever); 0: no cap
+} lmp_batch_opts_t;
+
+/* Called, from the worker thread that did the render, with each completed
+ * job.  The samples belong to the worker, and are only valid until this
+ * returns.  status is 0, or -1 if the module couldn't be played (in which
+ * case there are no samples).  Calls for different jobs can be concurrent.
+ */
+typedef void	(*lmp_batch_done_t)(const lmp_batch_job_t *job, int status,
+				    const int16_t *samples, size_t num_samples,
+				    void *arg);
+
+/* Render all jobs, returning when they're complete.  Returns the number of
+ * jobs that failed, or -1 if the threads couldn't be started.
+ */
+int	lmp_batch_render(const lmp_batch_job_t *jobs, unsigned int num_jobs,
+			 const lmp_batch_opts_t *opts, lmp_batch_done_t done,
+			 void *arg);
+
+/* Render the next frames of one player (which isn't changed) into out, which
+ * has room for frames (i.e. frames*2 samples for stereo).  The song is split
+ * into segments, at rows, that are rendered concurrently on threads (0: one
+ * per online CPU).  Each segment starts from an lmp_seek() snapshot, which
+ * carries all of the player's state (including, at an LMP_OPT_RATE_SHIFT,
+ * the interpolator's), so the output is identical to rendering it serially.
+ * Returns 0, or -1 if out of memory.
+ */
+int	lmp_batch_render_song(const mps_t *mps, lmp_mix_t mix_type, int16_t *out,
+			      uint32_t frames, unsigned int threads);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Little Module Player throughput benchmark
+ *
+ * Loads a directory of MODs (or a list of files) into memory, then renders
+ * each with lmp_fill_buffer() in every mix mode, at several buffer sizes.
+ * Reports output samples/sec, ns per frame and the multiple of realtime.
+ *
+ * >  lmp_bench [-c cpu] [-s seconds] [-r rate] <dir or files...>
+ *
+ * -c pins the benchmark to one CPU, for repeatable numbers.
+ *
+ * (c) 2021 Matt Evans
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "littlemodplayer.h"
+
+/* lmp may read a little beyond the end of the final sample */
+#define MOD_PADDING		4096
+#define MAX_BUFFERSIZE		8192	/* In samples */
+
+typedef struct {
+	char *name;
+	uint8_t *data;
+	lmp_module_t mod;
+} module_t;
+
+static const struct {
+	lmp_mix_t type;
+	const char *name;
+	unsigned int channels;
+} mix_modes[] = {
+	{ LMP_MONO,		"mono",	1 },
+	{ LMP_STEREO_HARD,	"hard",	2 },
+	{ LMP_STEREO_SOFT,	"soft",	2 },
+};
+
+static const unsigned int buffer_sizes[] = { 64, 256, 1024, 4096 };
+
+#define ARRAY_SIZE(x)		(sizeof(x)/sizeof((x)[0]))
+
+static module_t *modules;
+static unsigned int num_modules;
+
+static double	now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int	load_module(const char *path)
+{
+	struct stat sb;
+	module_t *grown;
+	uint8_t *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < 0x43c) {
+		fprintf(stderr, "%s: not a module\n", path);
+		close(fd);
+		return -1;
+	}
+
+	data = calloc(1, sb.st_size + MOD_PADDING);
+	if (!data) {
+		fprintf(stderr, "Can't alloc %ld!\n", (long)sb.st_size);
+		close(fd);
+		return -1;
+	}
+	for (off_t got = 0; got < sb.st_size; ) {
+		ssize_t r = read(fd, data + got, sb.st_size - got);
+		if (r <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			free(data);
+			close(fd);
+			return -1;
+		}
+		got += r;
+	}
+	close(fd);
+
+	grown = realloc(modules, (num_modules + 1)*sizeof(module_t));
+	if (!grown) {
+		fprintf(stderr, "Can't alloc %u modules!\n", num_modules + 1);
+		free(data);
+		return -1;
+	}
+	modules = grown;
+	if (lmp_module_init(&modules[num_modules].mod, data)) {
+		fprintf(stderr, "%s: too many channels\n", path);
+		free(data);
+		return -1;
+	}
+	if (modules[num_modules].mod.packed && !LMP_PACK_WINDOW) {
+		fprintf(stderr, "%s: packed, and LMP_PACK_WINDOW is 0\n", path);
+		free(data);
+		return -1;
+	}
+	modules[num_modules].name = strdup(path);
+	modules[num_modules].data = data;
+	num_modules++;
+	return 0;
+}
+
+static int	compare_modules(const void *a, const void *b)
+{
+	return strcmp(((const module_t *)a)->name, ((const module_t *)b)->name);
+}
+
+static void	load_dir(const char *path)
+{
+	DIR *d = opendir(path);
+	struct dirent *de;
+
+	if (!d) {
+		perror(path);
+		return;
+	}
+	while ((de = readdir(d))) {
+		size_t l = strlen(de->d_name);
+		char *p;
+
+		if (l < 4 || strcasecmp(de->d_name + l - 4, ".mod"))
+			continue;
+		if (asprintf(&p, "%s/%s", path, de->d_name) < 0)
+			continue;
+		load_module(p);
+		free(p);
+	}
+	closedir(d);
+}
+
+static void	usage(const char *me)
+{
+	fprintf(stderr, "Syntax: %s [-c cpu] [-s seconds] [-r rate] <dir or files...>\n", me);
+	exit(1);
+}
+
+int 	main(int argc, char *argv[])
+{
+	static int16_t	sample_buffer[MAX_BUFFERSIZE];
+	unsigned int	seconds = 60;
+	unsigned int	rate = 44100;
+	int		cpu = -1;
+	int		opt;
+
+	while ((opt = getopt(argc, argv, "c:s:r:")) != -1) {
+		switch (opt) {
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+			case 's':
+				seconds = atoi(optarg);
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc || seconds == 0)
+		usage(argv[0]);
+
+	if (cpu >= 0) {
+#ifdef __linux__
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("sched_setaffinity");
+			return 1;
+		}
+#else
+		fprintf(stderr, "CPU pinning not supported here, ignoring -c\n");
+#endif
+	}
+
+	for (int i = optind; i < argc; i++) {
+		struct stat sb;
+
+		if (stat(argv[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+			load_dir(argv[i]);
+		else
+			load_module(argv[i]);
+	}
+	if (num_modules == 0) {
+		fprintf(stderr, "No modules loaded\n");
+		return 1;
+	}
+	qsort(modules, num_modules, sizeof(module_t), compare_modules);
+
+	printf("%u modules, %us of audio each at %uHz\n\n", num_modules, seconds, rate);
+	printf("%-32s %-5s %6s %14s %10s %10s\n",
+	       "module", "mix", "buffer", "samples/s", "ns/frame", "realtime");
+
+	for (unsigned int m = 0; m < ARRAY_SIZE(mix_modes); m++) {
+		for (unsigned int b = 0; b < ARRAY_SIZE(buffer_sizes); b++) {
+			unsigned int bufsize = buffer_sizes[b];
+			unsigned int frames_per_buf = bufsize/mix_modes[m].channels;
+			unsigned long frames = (unsigned long)seconds*rate;
+			unsigned long nbufs = (frames + frames_per_buf - 1)/frames_per_buf;
+			double total_time = 0;
+
+			frames = nbufs*frames_per_buf;
+
+			for (unsigned int i = 0; i < num_modules; i++) {
+				mps_t mpstate;
+				const char *name = strrchr(modules[i].name, '/');
+
+				lmp_player_init(&mpstate, &modules[i].mod);
+				lmp_set_option(&mpstate, LMP_OPT_SAMPLERATE, rate);
+				lmp_set_option(&mpstate, LMP_OPT_LOOP, 1);
+
+				double t = now();
+				for (unsigned long n = 0; n < nbufs; n++)
+					lmp_fill_buffer(&mpstate, sample_buffer, bufsize,
+							mix_modes[m].type);
+				t = now() - t;
+				total_time += t;
+
+				printf("%-32.32s %-5s %6u %14.0f %10.2f %9.1fx\n",
+				       name ? name + 1 : modules[i].name,
+				       mix_modes[m].name, bufsize,
+				       frames*mix_modes[m].channels/t,
+				       t*1e9/frames, (double)frames/rate/t);
+			}
+
+			if (num_modules > 1) {
+				printf("%-32s %-5s %6u %14.0f %10.2f %9.1fx\n",
+				       "(all)", mix_modes[m].name, bufsize,
+				       num_modules*frames*mix_modes[m].channels/total_time,
+				       total_time*1e9/(num_modules*frames),
+				       num_modules*(double)frames/rate/total_time);
+			}
+		}
+	}
+
+	return 0;
+}
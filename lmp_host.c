@@ -0,0 +1,424 @@
+/*
+ * Little Module Player host producer thread
+ *
+ * For desktop and server hosts, whose audio callback runs at realtime
+ * priority and mustn't stall: a producer thread renders ahead into a ring of
+ * frames, and the callback (lmp_host_read()) only copies out of it.  The
+ * ring is single-producer single-consumer, with a free-running frame count
+ * at each end, so neither side locks.  The producer keeps the ring filled to
+ * the lead time, and sleeps in between.
+ *
+ * Changes to the player go to the producer as messages, on a second small
+ * ring, and are applied between chunks.  Repositioning also moves a flush
+ * mark to where the new frames start, and the reader skips up to it.
+ *
+ * Built with LMP_HOST_MAIN, this is also a tool that plays a module to
+ * stdout in real time, reading it as an audio callback would:
+ *
+ * >  lmp_host [-r rate] [-m mono|hard|soft] [-l lead_ms] [-p period] [-t seconds] song.mod | aplay -f cd
+ *
+ * It reports the underruns at the end.
+ *
+ * (c) 2021 Matt Evans
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "lmp_host.h"
+
+#define DEFAULT_LEAD		8192	/* In frames */
+#define DEFAULT_CHUNK		512
+#define CACHELINE		64
+
+/* Messages in flight, a power of two: */
+#define HOST_MESSAGES		16
+
+typedef enum {
+	HOST_SET_POS,
+	HOST_SEEK,
+	HOST_SET_OPTION,
+} lmp_host_msg_type_t;
+
+typedef struct {
+	lmp_host_msg_type_t type;
+	const lmp_index_t *idx;
+	unsigned int arg;
+	unsigned int val;
+} lmp_host_msg_t;
+
+struct lmp_host {
+	mps_t *mps;
+	lmp_mix_t mix_type;
+	unsigned int spf;		// Samples per frame
+	unsigned int lead, chunk;
+	unsigned int size;		// Frames in the ring, a power of two
+	int16_t *ring;
+	pthread_t thread;
+
+	/* Written by the producer: */
+	_Alignas(CACHELINE) _Atomic uint32_t write;
+	_Atomic uint32_t flush;		// Frames before this are stale
+	_Atomic int ended;		// The song ended at write
+	_Atomic uint32_t msg_tail;
+
+	/* Written by the reader: */
+	_Alignas(CACHELINE) _Atomic uint32_t read;
+	_Atomic uint32_t underruns;
+
+	/* Written by the controller: */
+	_Alignas(CACHELINE) _Atomic uint32_t msg_head;
+	_Atomic int quit;
+	lmp_host_msg_t msgs[HOST_MESSAGES];
+};
+
+/* Apply the queued messages, returns non-zero if the song moved */
+static int	lmp_host_apply(lmp_host_t *h)
+{
+	uint32_t tail = atomic_load_explicit(&h->msg_tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&h->msg_head, memory_order_acquire);
+	int moved = 0;
+
+	for (; tail != head; tail++) {
+		const lmp_host_msg_t *m = &h->msgs[tail % HOST_MESSAGES];
+
+		switch (m->type) {
+			case HOST_SET_POS:
+				lmp_set_pos(h->mps, m->arg);
+				moved = 1;
+				break;
+			case HOST_SEEK:
+				if (lmp_seek(h->mps, m->idx, m->arg) == 0)
+					moved = 1;
+				break;
+			case HOST_SET_OPTION:
+				lmp_set_option(h->mps, m->arg, m->val);
+				break;
+		}
+	}
+	atomic_store_explicit(&h->msg_tail, tail, memory_order_release);
+	return moved;
+}
+
+static void	*lmp_host_producer(void *arg)
+{
+	lmp_host_t *h = arg;
+	uint32_t w = 0;
+
+	while (!atomic_load_explicit(&h->quit, memory_order_relaxed)) {
+		uint32_t r, f;
+		unsigned int off, first;
+		int more;
+
+		if (lmp_host_apply(h)) {
+			/* The new position's frames start here; the reader
+			 * drops the ones it hasn't read before it:
+			 */
+			atomic_store_explicit(&h->flush, w, memory_order_release);
+			atomic_store_explicit(&h->ended, 0, memory_order_relaxed);
+		}
+		r = atomic_load_explicit(&h->read, memory_order_acquire);
+		f = atomic_load_explicit(&h->flush, memory_order_relaxed);
+		if (f - r <= w - r)
+			r = f;
+
+		if (atomic_load_explicit(&h->ended, memory_order_relaxed) ||
+		    w - r >= h->lead) {
+			/* Nap for a quarter of a chunk: */
+			struct timespec ts = {
+				0, (long)((uint64_t)h->chunk*250000000/h->mps->samplerate)
+			};
+
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		/* The ring holds the lead plus a chunk, so there's room: */
+		off = w & (h->size - 1);
+		first = h->size - off;
+		if (first > h->chunk)
+			first = h->chunk;
+		more = lmp_fill_buffer(h->mps, h->ring + off*h->spf, first*h->spf, h->mix_type);
+		if (more && first < h->chunk)
+			more = lmp_fill_buffer(h->mps, h->ring, (h->chunk - first)*h->spf,
+					       h->mix_type);
+		w += h->chunk;
+		atomic_store_explicit(&h->write, w, memory_order_release);
+		if (!more)
+			atomic_store_explicit(&h->ended, 1, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+lmp_host_t	*lmp_host_start(mps_t *mps, const lmp_host_opts_t *opts)
+{
+	lmp_host_t *h;
+
+	h = calloc(1, sizeof(lmp_host_t));
+	if (!h)
+		return NULL;
+	h->mps = mps;
+	h->mix_type = opts->mix_type;
+	h->spf = (opts->mix_type == LMP_MONO) ? 1 : 2;
+	h->lead = opts->lead_frames ? opts->lead_frames : DEFAULT_LEAD;
+	h->chunk = opts->chunk_frames ? opts->chunk_frames : DEFAULT_CHUNK;
+	for (h->size = 1; h->size < h->lead + h->chunk; h->size <<= 1)
+		;
+
+	/* Touch the ring now, so the reader never takes a page fault: */
+	h->ring = malloc((size_t)h->size*h->spf*sizeof(int16_t));
+	if (!h->ring) {
+		free(h);
+		return NULL;
+	}
+	memset(h->ring, 0, (size_t)h->size*h->spf*sizeof(int16_t));
+
+	if (pthread_create(&h->thread, NULL, lmp_host_producer, h)) {
+		free(h->ring);
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+void		lmp_host_stop(lmp_host_t *h)
+{
+	atomic_store_explicit(&h->quit, 1, memory_order_relaxed);
+	pthread_join(h->thread, NULL);
+	free(h->ring);
+	free(h);
+}
+
+unsigned int	lmp_host_read(lmp_host_t *h, int16_t *out, unsigned int frames)
+{
+	uint32_t r = atomic_load_explicit(&h->read, memory_order_relaxed);
+	/* Load write first: a flush mark before it is then visible too. */
+	uint32_t w = atomic_load_explicit(&h->write, memory_order_acquire);
+	uint32_t f = atomic_load_explicit(&h->flush, memory_order_acquire);
+	unsigned int n, off, first;
+
+	if (f - r <= w - r)
+		r = f;
+	n = w - r;
+	if (n > frames)
+		n = frames;
+
+	off = r & (h->size - 1);
+	first = h->size - off;
+	if (first > n)
+		first = n;
+	memcpy(out, h->ring + off*h->spf, first*h->spf*sizeof(int16_t));
+	memcpy(out + first*h->spf, h->ring, (n - first)*h->spf*sizeof(int16_t));
+	atomic_store_explicit(&h->read, r + n, memory_order_release);
+
+	if (n < frames) {
+		memset(out + n*h->spf, 0, (frames - n)*h->spf*sizeof(int16_t));
+		if (!atomic_load_explicit(&h->ended, memory_order_relaxed))
+			atomic_fetch_add_explicit(&h->underruns, frames - n,
+						  memory_order_relaxed);
+	}
+	return n;
+}
+
+uint32_t	lmp_host_underruns(lmp_host_t *h)
+{
+	return atomic_load_explicit(&h->underruns, memory_order_relaxed);
+}
+
+int		lmp_host_done(lmp_host_t *h)
+{
+	return atomic_load_explicit(&h->ended, memory_order_acquire) &&
+		atomic_load_explicit(&h->read, memory_order_relaxed) ==
+		atomic_load_explicit(&h->write, memory_order_relaxed);
+}
+
+static int	lmp_host_send(lmp_host_t *h, lmp_host_msg_type_t type,
+			      const lmp_index_t *idx, unsigned int arg, unsigned int val)
+{
+	uint32_t head = atomic_load_explicit(&h->msg_head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&h->msg_tail, memory_order_acquire);
+	lmp_host_msg_t *m;
+
+	if (head - tail >= HOST_MESSAGES)
+		return -1;
+	m = &h->msgs[head % HOST_MESSAGES];
+	m->type = type;
+	m->idx = idx;
+	m->arg = arg;
+	m->val = val;
+	atomic_store_explicit(&h->msg_head, head + 1, memory_order_release);
+	return 0;
+}
+
+int		lmp_host_set_pos(lmp_host_t *h, unsigned int pos)
+{
+	return lmp_host_send(h, HOST_SET_POS, NULL, pos, 0);
+}
+
+int		lmp_host_seek(lmp_host_t *h, const lmp_index_t *idx, uint32_t frame)
+{
+	return lmp_host_send(h, HOST_SEEK, idx, frame, 0);
+}
+
+int		lmp_host_set_option(lmp_host_t *h, unsigned int option, unsigned int val)
+{
+	return lmp_host_send(h, HOST_SET_OPTION, NULL, option, val);
+}
+
+#ifdef LMP_HOST_MAIN
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* lmp may read a little beyond the end of the final sample */
+#define MOD_PADDING		4096
+
+static uint8_t	*load_file(const char *path)
+{
+	struct stat sb;
+	uint8_t *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < 0x43c) {
+		fprintf(stderr, "%s: not a module\n", path);
+		close(fd);
+		return NULL;
+	}
+	data = calloc(1, sb.st_size + MOD_PADDING);
+	if (!data) {
+		fprintf(stderr, "Can't alloc %ld!\n", (long)sb.st_size);
+		close(fd);
+		return NULL;
+	}
+	for (off_t got = 0; got < sb.st_size; ) {
+		ssize_t r = read(fd, data + got, sb.st_size - got);
+		if (r <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		got += r;
+	}
+	close(fd);
+	return data;
+}
+
+static void	usage(const char *me)
+{
+	fprintf(stderr, "Syntax: %s [-r rate] [-m mono|hard|soft] [-l lead_ms] "
+		"[-p period] [-t seconds] <file>\n", me);
+	exit(1);
+}
+
+int 	main(int argc, char *argv[])
+{
+	lmp_host_opts_t opts = { .mix_type = LMP_STEREO_SOFT };
+	unsigned int rate = 44100;
+	unsigned int lead_ms = 200;
+	unsigned int period = 256;
+	unsigned int seconds = 60*5;
+	struct timespec next;
+	lmp_module_t mod;
+	mps_t mps;
+	lmp_host_t *h;
+	int16_t *buf;
+	uint8_t *data;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:m:l:p:t:")) != -1) {
+		switch (opt) {
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'm':
+				if (!strcmp(optarg, "mono"))
+					opts.mix_type = LMP_MONO;
+				else if (!strcmp(optarg, "hard"))
+					opts.mix_type = LMP_STEREO_HARD;
+				else if (!strcmp(optarg, "soft"))
+					opts.mix_type = LMP_STEREO_SOFT;
+				else
+					usage(argv[0]);
+				break;
+			case 'l':
+				lead_ms = atoi(optarg);
+				break;
+			case 'p':
+				period = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || period == 0 || rate == 0)
+		usage(argv[0]);
+
+	data = load_file(argv[optind]);
+	if (!data)
+		return 1;
+	if (lmp_module_init(&mod, data)) {
+		fprintf(stderr, "%s: can't play\n", argv[optind]);
+		return 1;
+	}
+	if (mod.packed) {
+		/* Packed instruments are unpacked into RAM: */
+		unsigned int size = lmp_arena_size(&mod);
+		void *arena = malloc(size);
+
+		if (arena)
+			lmp_load_arena(&mod, arena, size);
+	}
+	if (lmp_player_init(&mps, &mod)) {
+		fprintf(stderr, "%s: can't play\n", argv[optind]);
+		return 1;
+	}
+	lmp_set_option(&mps, LMP_OPT_SAMPLERATE, rate);
+
+	buf = malloc(period*2*sizeof(int16_t));
+	opts.lead_frames = (uint64_t)rate*lead_ms/1000;
+	h = lmp_host_start(&mps, &opts);
+	if (!buf || !h) {
+		fprintf(stderr, "Can't start the producer\n");
+		return 1;
+	}
+
+	/* Act as the audio callback, once a period: */
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (uint64_t frames = 0; frames < (uint64_t)seconds*rate && !lmp_host_done(h);
+	     frames += period) {
+		unsigned int spf = (opts.mix_type == LMP_MONO) ? 1 : 2;
+
+		lmp_host_read(h, buf, period);
+		if (fwrite(buf, sizeof(int16_t), period*spf, stdout) != period*spf)
+			break;
+
+		next.tv_nsec += (uint64_t)period*1000000000/rate;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	fprintf(stderr, "%u frames of underrun\n", lmp_host_underruns(h));
+	lmp_host_stop(h);
+	free(buf);
+	free(data);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef LMP_HOST_H
+#define LMP_HOST_H
+
+#include "littlemodplayer.h"
+
+/* Rendering ahead on a producer thread, for hosts whose audio callback
+ * mustn't do anything that could stall (see lmp_host.c)
+ */
+
+typedef struct lmp_host lmp_host_t;
+
+typedef struct {
+	lmp_mix_t mix_type;
+	unsigned int lead_frames;	// Rendered ahead of the callback; 0: 8192
+	unsigned int chunk_frames;	// Rendered at a time; 0: 512
+} lmp_host_opts_t;
+
+/* Start a producer thread rendering a player, which belongs to it until
+ * lmp_host_stop().  Returns NULL if out of memory or the thread couldn't be
+ * started.
+ */
+lmp_host_t	*lmp_host_start(mps_t *mps, const lmp_host_opts_t *opts);
+void		lmp_host_stop(lmp_host_t *h);
+
+/* From the audio callback: copy out frames (stereo pairs for stereo mixes),
+ * zero-filling any that aren't ready.  Returns the number that were.  This
+ * only copies, and doesn't lock or allocate.
+ */
+unsigned int	lmp_host_read(lmp_host_t *h, int16_t *out, unsigned int frames);
+
+/* Frames zero-filled because the producer was behind, and whether the song
+ * has ended (not looping) and been read out.
+ */
+uint32_t	lmp_host_underruns(lmp_host_t *h);
+int		lmp_host_done(lmp_host_t *h);
+
+/* Messages to the producer, which applies them between chunks.  Send them
+ * from one thread.  Repositioning drops what's been rendered ahead, so that
+ * it's heard straight away.  Return 0, or -1 if the queue is full.
+ */
+int		lmp_host_set_pos(lmp_host_t *h, unsigned int pos);
+int		lmp_host_seek(lmp_host_t *h, const lmp_index_t *idx, uint32_t frame);
+int		lmp_host_set_option(lmp_host_t *h, unsigned int option, unsigned int val);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Little Module Player sample packer
+ *
+ * Packs a module's instruments into 4-bit delta blocks (see LMP_PACK_BLOCK
+ * in littlemodplayer.h), for about half the size, which LMP plays directly
+ * (decoding a block at a time into each voice's window) or unpacks into an
+ * arena.  The header and patterns are unchanged, except for the tag, which
+ * becomes "LPnn" for nn channels.
+ *
+ * >  lmp_pack <infile.mod> <outfile>
+ *
+ * This is lossy:  each block picks the delta scale that fits it best, so
+ * quiet and smooth instruments come through nearly untouched, and loud,
+ * noisy ones get a little noisier.  Loops running past the end of their
+ * instrument are clamped to it, as lmp_load_arena() does.
+ *
+ * (c) 2021 Matt Evans
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "littlemodplayer.h"
+
+/* The instruments might run off the end of the file; read zeros there */
+#define MOD_PADDING		(128*1024)
+
+static uint8_t	*load_module(const char *path, size_t *len)
+{
+	struct stat sb;
+	uint8_t *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < 0x43c) {
+		fprintf(stderr, "%s: not a module\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	data = calloc(1, sb.st_size + MOD_PADDING);
+	if (!data) {
+		fprintf(stderr, "Can't alloc %ld!\n", (long)sb.st_size);
+		close(fd);
+		return NULL;
+	}
+	for (off_t got = 0; got < sb.st_size; ) {
+		ssize_t r = read(fd, data + got, sb.st_size - got);
+		if (r <= 0) {
+			fprintf(stderr, "%s: short read\n", path);
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		got += r;
+	}
+	close(fd);
+	*len = sb.st_size;
+	return data;
+}
+
+static void	put_be16(uint8_t *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+/* Encode samples against a decoder starting from x[0], scaling the deltas
+ * by 1 << shift.  Returns the squared error, and writes out the deltas
+ * if out isn't NULL.
+ */
+static uint64_t	encode_block(const int8_t *x, unsigned int shift, uint8_t *out)
+{
+	int s = x[0];
+	uint64_t err = 0;
+
+	for (int i = 0; i < LMP_PACK_BLOCK; i++) {
+		int diff = x[i] - s;
+		/* Round to the nearest step: */
+		int d = (diff + (diff >= 0 ? 1 : -1) * ((1 << shift) >> 1)) / (1 << shift);
+
+		d = (d < -8) ? -8 : (d > 7) ? 7 : d;
+		s += d * (1 << shift);
+		s = (s < -128) ? -128 : (s > 127) ? 127 : s;
+		err += (uint64_t)((x[i] - s) * (x[i] - s));
+		if (out)
+			out[i/2] |= (d & 0xf) << ((i & 1) * 4);
+	}
+	return err;
+}
+
+/* Pack len samples into LMP_PACK_SIZE(len) bytes, padding the last block
+ * with its final sample.  Returns the squared error over the instrument.
+ */
+static uint64_t	pack_instrument(uint8_t *dest, const int8_t *src, unsigned int len)
+{
+	uint64_t total = 0;
+
+	for (unsigned int i = 0; i < len; i += LMP_PACK_BLOCK) {
+		int8_t x[LMP_PACK_BLOCK];
+		unsigned int n = (len - i < LMP_PACK_BLOCK) ? len - i : LMP_PACK_BLOCK;
+		unsigned int best = 0;
+		uint64_t best_err = UINT64_MAX;
+
+		memcpy(x, src + i, n);
+		for (unsigned int k = n; k < LMP_PACK_BLOCK; k++)
+			x[k] = x[n - 1];
+
+		for (unsigned int shift = 0; shift <= 4; shift++) {
+			uint64_t err = encode_block(x, shift, NULL);
+
+			if (err < best_err) {
+				best_err = err;
+				best = shift;
+			}
+		}
+
+		memset(dest, 0, LMP_PACK_BLOCK_BYTES);
+		dest[0] = (uint8_t)x[0];
+		dest[1] = best;
+		encode_block(x, best, dest + 2);
+		total += best_err;
+		dest += LMP_PACK_BLOCK_BYTES;
+	}
+	return total;
+}
+
+int 	main(int argc, char *argv[])
+{
+	lmp_module_t mod;
+	uint8_t *data, *out;
+	size_t len;
+	unsigned int hdr, size;
+	uint64_t err = 0, samples = 0;
+	FILE *f;
+
+	if (argc != 3) {
+		fprintf(stderr, "Syntax: %s <infile.mod> <outfile>\n", argv[0]);
+		return 1;
+	}
+
+	data = load_module(argv[1], &len);
+	if (!data)
+		return 1;
+	if (lmp_module_init(&mod, data)) {
+		fprintf(stderr, "%s: can't play this module\n", argv[1]);
+		return 1;
+	}
+	/* The tag says how many channels, in two digits, so there has to be one: */
+	if (!mod.thirtyone || mod.flt8 || mod.packed || mod.channels > 99) {
+		fprintf(stderr, "%s: can only pack 31-instrument modules (not FLT8, or packed)\n",
+			argv[1]);
+		return 1;
+	}
+
+	/* Header and patterns, then each instrument packed: */
+	hdr = (uint8_t *)mod.inst[0].sample - data;
+	size = hdr;
+	for (int i = 0; i < 31; i++)
+		size += LMP_PACK_SIZE(mod.inst[i].len);
+
+	out = calloc(1, size);
+	if (!out) {
+		fprintf(stderr, "Can't alloc %u!\n", size);
+		return 1;
+	}
+	memcpy(out, data, hdr);
+	char tag[5];
+	snprintf(tag, sizeof(tag), "LP%02u", mod.channels % 100U);
+	memcpy(out + 0x438, tag, 4);
+
+	uint8_t *dest = out + hdr;
+	for (int i = 0; i < 31; i++) {
+		mpsamp_t *in = &mod.inst[i];
+		uint8_t *instr = out + 0x14 + i*30;
+
+		if (in->repeat_len != 1*2) {
+			if (in->repeat_pos >= in->len) {
+				in->repeat_pos = 0;
+				in->repeat_len = 1*2;
+			} else if (in->repeat_pos + in->repeat_len > in->len) {
+				in->repeat_len = in->len - in->repeat_pos;
+			}
+			put_be16(instr + 26, in->repeat_pos/2);
+			put_be16(instr + 28, in->repeat_len/2);
+		}
+
+		err += pack_instrument(dest, in->sample, in->len);
+		samples += in->len;
+		dest += LMP_PACK_SIZE(in->len);
+	}
+
+	f = fopen(argv[2], "wb");
+	if (!f || fwrite(out, 1, size, f) != size || fclose(f)) {
+		perror(argv[2]);
+		return 1;
+	}
+	fprintf(stderr, "%s: %zu to %u bytes, RMS error %.2f\n", argv[1], len, size,
+		samples ? sqrt((double)err/samples) : 0.0);
+	return 0;
+}